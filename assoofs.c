@@ -4,87 +4,2503 @@
 #include <linux/fs.h>           /* libfs stuff           */
 #include <linux/buffer_head.h>  /* buffer_head           */
 #include <linux/slab.h>         /* kmem_cache            */
+#include <linux/sort.h>         /* sort                  */
+#include <linux/mpage.h>        /* mpage_readahead       */
+#include <linux/blockgroup_lock.h> /* blockgroup_lock     */
+#include <linux/iversion.h>     /* inode_inc_iversion    */
+#include <linux/highmem.h>      /* kmap_atomic           */
+#include <linux/pagemap.h>      /* grab_cache_page_write_begin */
+#include <linux/percpu.h>       /* alloc_percpu          */
+#include <linux/debugfs.h>      /* debugfs_create_dir    */
+#include <linux/seq_file.h>     /* seq_printf            */
+#include <linux/ktime.h>        /* ktime_get_ns          */
+#include <linux/log2.h>         /* ilog2                 */
+#include <linux/percpu_counter.h> /* percpu_counter      */
+#include <linux/workqueue.h>    /* delayed_work          */
+#include <linux/statfs.h>       /* kstatfs               */
+#include <linux/jbd2.h>         /* journal_t             */
+#include <linux/list_lru.h>     /* list_lru              */
+#include <linux/rculist.h>      /* hlist_add_head_rcu    */
+#include <linux/hash.h>         /* hash_32               */
+#include <linux/iomap.h>        /* iomap_dio_rw          */
+#include <linux/uio.h>          /* iov_iter              */
+#include <linux/falloc.h>       /* FALLOC_FL_PUNCH_HOLE  */
 #include "assoofs.h"
 
+#define CREATE_TRACE_POINTS
+#include "assoofs_trace.h"
+
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Alejandro Perez Fernandez");
 
 
-static struct kmem_cache *assoofs_inode_cache;
-static DEFINE_MUTEX(assoofs_sb_lock);
-static DEFINE_MUTEX(assoofs_inodes_mgmt_lock);
+static struct kmem_cache *assoofs_inode_cache;
+static struct dentry *assoofs_debugfs_root; // /sys/kernel/debug/assoofs
+
+/*
+ * Estadisticas por volumen, en /sys/kernel/debug/assoofs/<dispositivo>/stats.
+ * Son contadores por CPU, asi que actualizarlas no comparte lineas de cache
+ * entre CPUs; solo se suman al leer el fichero.
+ */
+enum assoofs_stat {
+    ASSOOFS_STAT_LOOKUPS,
+    ASSOOFS_STAT_LOOKUP_MISSES,     // el nombre no existe
+    ASSOOFS_STAT_ICACHE_HITS,       // assoofs_iget encontro el inodo en memoria
+    ASSOOFS_STAT_ICACHE_MISSES,     // assoofs_iget leyo la tabla de inodos
+    ASSOOFS_STAT_DCACHE_BUILDS,     // caches de nombres de directorio construidas leyendo sus hojas
+    ASSOOFS_STAT_META_READS,        // bloques de metadatos pedidos con sb_bread
+    ASSOOFS_STAT_DATA_READS,        // paginas de datos leidas
+    ASSOOFS_STAT_DATA_WRITES,       // paginas de datos escritas
+    ASSOOFS_STAT_DIO_READS,         // lecturas O_DIRECT
+    ASSOOFS_STAT_DIO_WRITES,        // escrituras O_DIRECT
+    ASSOOFS_STAT_ALLOCS,            // llamadas al asignador de bloques
+    ASSOOFS_STAT_ALLOC_SCANNED,     // bloques del mapa de bits recorridos por el asignador
+    ASSOOFS_STAT_LOCK_WAITS,        // veces que hubo que esperar un cerrojo
+    ASSOOFS_STAT_LOCK_WAIT_NS,      // tiempo total esperando cerrojos
+    ASSOOFS_STAT_NR,
+};
+
+static const char * const assoofs_stat_names[ASSOOFS_STAT_NR] = {
+    [ASSOOFS_STAT_LOOKUPS]          = "lookups",
+    [ASSOOFS_STAT_LOOKUP_MISSES]    = "lookup_misses",
+    [ASSOOFS_STAT_ICACHE_HITS]      = "icache_hits",
+    [ASSOOFS_STAT_ICACHE_MISSES]    = "icache_misses",
+    [ASSOOFS_STAT_DCACHE_BUILDS]    = "dir_cache_builds",
+    [ASSOOFS_STAT_META_READS]       = "meta_reads",
+    [ASSOOFS_STAT_DATA_READS]       = "data_page_reads",
+    [ASSOOFS_STAT_DATA_WRITES]      = "data_page_writes",
+    [ASSOOFS_STAT_DIO_READS]        = "dio_reads",
+    [ASSOOFS_STAT_DIO_WRITES]       = "dio_writes",
+    [ASSOOFS_STAT_ALLOCS]           = "allocs",
+    [ASSOOFS_STAT_ALLOC_SCANNED]    = "alloc_bitmap_blocks_scanned",
+    [ASSOOFS_STAT_LOCK_WAITS]       = "lock_waits",
+    [ASSOOFS_STAT_LOCK_WAIT_NS]     = "lock_wait_ns",
+};
+
+// Histogramas de latencia: el cubo b cuenta las operaciones de [2^b, 2^(b+1)) ns
+enum assoofs_hist {
+    ASSOOFS_HIST_LOOKUP,
+    ASSOOFS_HIST_GET_BLOCK,
+    ASSOOFS_HIST_ALLOC,
+    ASSOOFS_HIST_LOCK_WAIT,
+    ASSOOFS_HIST_NR,
+};
+
+#define ASSOOFS_HIST_BUCKETS 32
+
+static const char * const assoofs_hist_names[ASSOOFS_HIST_NR] = {
+    [ASSOOFS_HIST_LOOKUP]       = "lookup",
+    [ASSOOFS_HIST_GET_BLOCK]    = "get_block",
+    [ASSOOFS_HIST_ALLOC]        = "alloc",
+    [ASSOOFS_HIST_LOCK_WAIT]    = "lock_wait",
+};
+
+struct assoofs_stats {
+    u64 count[ASSOOFS_STAT_NR];
+    u64 hist[ASSOOFS_HIST_NR][ASSOOFS_HIST_BUCKETS];
+};
+
+// Segundos como maximo entre un cambio de los contadores y su copia al superbloque
+#define ASSOOFS_COMMIT_INTERVAL 5
+
+// Bloques de metadatos vecinos que se piden de una vez al leer uno que no esta en cache
+#define ASSOOFS_META_READAHEAD 8
+
+// Bits de s_flags
+#define ASSOOFS_SB_DIRTY 0  // Los contadores en memoria difieren del superbloque
+
+/*
+ * Lote de bloques y de numeros de inodo que cada CPU aparta de una vez y
+ * reparte despues sin volver a buscar. El lote solo existe en memoria (en el
+ * mapa de apartados de su grupo): el bit del mapa de bits en disco se marca al
+ * repartir cada entrada, asi que una caida no pierde lo que no se ha usado.
+ */
+#define ASSOOFS_POOL_BLOCKS 64
+#define ASSOOFS_POOL_INODES 32
+
+struct assoofs_pool {
+    struct mutex lock;      // Solo compite con assoofs_drain_pools o con otra tarea en la misma CPU
+    uint64_t block;         // Siguiente bloque del lote
+    uint32_t blocks;        // Bloques que quedan
+    uint32_t inodes;        // Numeros de inodo que quedan
+    uint64_t inode_no;      // Siguiente numero del lote
+};
+
+// Contadores en memoria de un grupo: los de su descriptor, al dia
+struct assoofs_group_info {
+    atomic_t free_blocks;
+    atomic_t free_inodes;
+    atomic_t dirs;
+    unsigned long *reserved;    // Apartado por los lotes: bits de bloques y detras los de inodos. NULL hasta el primer lote
+};
+
+/*
+ * Informacion en memoria de cada volumen montado (sb->s_fs_info). Cada volumen
+ * tiene sus propios cerrojos, de modo que dos montajes no compiten entre si:
+ *  - s_bgl tiene un spinlock por grupo, que protege su bloque del mapa de
+ *    bits de bloques y el del mapa de inodos.
+ * Las entradas de la tabla de inodos se protegen con el cerrojo de su buffer
+ * (lock_buffer) y los directorios con el i_rwsem que ya toma la VFS.
+ *
+ * Los contadores del superbloque y de los grupos se llevan en memoria y solo
+ * se copian al disco en assoofs_commit_super: asi reservar bloques o inodos no
+ * toca un buffer compartido por todo el volumen. Los de un grupo se leen de su
+ * descriptor la primera vez que se usa (assoofs_group), no al montar.
+ */
+struct assoofs_sb_info {
+    struct buffer_head *s_sbh;                  // Bloque del superbloque, fijo en memoria
+    struct assoofs_super_block_info *s_asb;     // Apunta a s_sbh->b_data
+    struct assoofs_group_info *s_groups;        // Uno por grupo
+    struct assoofs_pool __percpu *s_pools;
+    struct buffer_head **s_group_desc;          // Bloques de la tabla de descriptores, NULL hasta que se usan
+    struct mutex s_group_lock;                  // Serializa la carga de s_group_desc
+    struct percpu_counter s_freeblocks_counter;
+    struct percpu_counter s_freeinodes_counter;
+    struct percpu_counter s_dirs_counter;
+    unsigned long s_flags;
+    struct delayed_work s_commit_work;
+    struct super_block *s_sb;
+    journal_t *s_journal;                       // NULL si el volumen no tiene diario
+    struct list_lru s_dcache_lru;               // Directorios con cache de nombres
+    struct shrinker s_dcache_shrinker;
+    struct blockgroup_lock s_bgl;
+    struct assoofs_stats __percpu *s_stats;
+    struct dentry *s_debugfs;
+};
+
+static inline struct assoofs_sb_info *ASSOOFS_SB(struct super_block *sb) {
+    return sb->s_fs_info;
+}
+
+static struct assoofs_group_info *assoofs_load_group_desc(struct super_block *sb, uint64_t group);
+
+// Puede dormir: la primera vez que se toca un bloque de descriptores se lee del disco
+static inline struct assoofs_group_info *assoofs_group(struct super_block *sb, uint64_t group) {
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    uint64_t index = group / (sb->s_blocksize / sizeof(struct assoofs_group_desc));
+
+    if (unlikely(!smp_load_acquire(&sbi->s_group_desc[index])))
+        return assoofs_load_group_desc(sb, group);
+    return &sbi->s_groups[group];
+}
+
+static inline uint64_t assoofs_block_group(struct super_block *sb, uint64_t block) {
+    return block / ASSOOFS_SB(sb)->s_asb->blocks_per_group;
+}
+
+static inline uint64_t assoofs_inode_group(struct super_block *sb, uint64_t inode_no) {
+    return (inode_no - ASSOOFS_ROOTDIR_INODE_NUMBER) / ASSOOFS_SB(sb)->s_asb->inodes_per_group;
+}
+
+static inline void assoofs_stat_add(struct super_block *sb, enum assoofs_stat stat, u64 n) {
+    this_cpu_add(ASSOOFS_SB(sb)->s_stats->count[stat], n);
+}
+
+static inline void assoofs_stat_inc(struct super_block *sb, enum assoofs_stat stat) {
+    assoofs_stat_add(sb, stat, 1);
+}
+
+// Anota en el histograma hist el tiempo transcurrido desde start (ktime_get_ns)
+static inline void assoofs_hist_since(struct super_block *sb, enum assoofs_hist hist, u64 start) {
+    u64 ns = ktime_get_ns() - start;
+    unsigned int bucket = ns ? min_t(unsigned int, ilog2(ns), ASSOOFS_HIST_BUCKETS - 1) : 0;
+
+    this_cpu_inc(ASSOOFS_SB(sb)->s_stats->hist[hist][bucket]);
+}
+
+/*
+ * sb_bread de un bloque de metadatos. Si no esta en cache se piden a la vez los
+ * ASSOOFS_META_READAHEAD siguientes, sin pasar de end (el final de la tabla o
+ * del mapa al que pertenece): suelen ser los proximos que hacen falta y asi
+ * llegan en una sola peticion en lugar de en una lectura sincrona cada uno.
+ */
+static struct buffer_head *assoofs_bread_ahead(struct super_block *sb, uint64_t block, uint64_t end) {
+    struct buffer_head *bh = sb_find_get_block(sb, block);
+    uint64_t b;
+
+    if (bh && buffer_uptodate(bh))
+        return bh;
+    brelse(bh);
+    for (b = block; b < end && b <= block + ASSOOFS_META_READAHEAD; b++)
+        sb_breadahead(sb, b);
+    return sb_bread(sb, block);
+}
+
+static void assoofs_lock_waited(struct super_block *sb, u64 start) {
+    assoofs_stat_inc(sb, ASSOOFS_STAT_LOCK_WAITS);
+    assoofs_stat_add(sb, ASSOOFS_STAT_LOCK_WAIT_NS, ktime_get_ns() - start);
+    assoofs_hist_since(sb, ASSOOFS_HIST_LOCK_WAIT, start);
+}
+
+/*
+ * Cerrojos con medida de la espera. Primero se prueba sin bloquear, de modo que
+ * el caso sin contencion no paga la lectura del reloj.
+ */
+static void assoofs_spin_lock(struct super_block *sb, spinlock_t *lock) {
+    u64 start;
+
+    if (spin_trylock(lock))
+        return;
+    start = ktime_get_ns();
+    spin_lock(lock);
+    assoofs_lock_waited(sb, start);
+}
+
+static void assoofs_down_write(struct super_block *sb, struct rw_semaphore *sem) {
+    u64 start;
+
+    if (down_write_trylock(sem))
+        return;
+    start = ktime_get_ns();
+    down_write(sem);
+    assoofs_lock_waited(sb, start);
+}
+
+/*
+ * Inodo en memoria: el struct inode de la VFS va dentro, de modo que cada inodo
+ * vivo es un unico objeto de assoofs_inode_cache (ver assoofs_alloc_inode).
+ * i_data_sem protege la lista de extensiones y el resto de info frente a
+ * get_block, la writeback y las altas en directorios.
+ */
+struct assoofs_inode {
+    struct assoofs_inode_info info;
+    struct rw_semaphore i_data_sem;
+    tid_t i_sync_tid;           // Ultima transaccion del diario que ha tocado la entrada del inodo
+    struct assoofs_dcache __rcu *i_dcache;  // Cache de nombres de un directorio, o NULL
+    spinlock_t i_dcache_lock;   // Publicar y desenganchar i_dcache
+    struct inode vfs_inode;
+};
+
+static inline struct assoofs_inode *ASSOOFS_I(struct inode *inode) {
+    return container_of(inode, struct assoofs_inode, vfs_inode);
+}
+
+static inline bool assoofs_has_inline_data(struct inode *inode) {
+    return ASSOOFS_I(inode)->info.flags & ASSOOFS_INODE_INLINE_DATA;
+}
+
+
+/*
+ *  Diario: los metadatos (mapa de bits, tabla de inodos, directorios, bloques
+ *  de extensiones y superbloque) se modifican dentro de un handle de jbd2. Las
+ *  operaciones concurrentes se unen a la misma transaccion, que kjournald2
+ *  escribe de una vez en el diario cada ASSOOFS_COMMIT_INTERVAL segundos o
+ *  cuando fsync la pide. Los datos de los ficheros no pasan por el diario.
+ *
+ *  El handle abierto se guarda en current->journal_info, asi que las funciones
+ *  que tocan metadatos no lo reciben como argumento. Abrir un handle con otro
+ *  ya abierto solo lo anida, pero el de fuera tiene que reservar los creditos
+ *  (bloques) de todo lo que se haga dentro. Sin diario, todo esto se reduce a
+ *  mark_buffer_dirty.
+ */
+
+// Mapa de bits (dos, si el bloque de extensiones cae en otro), bloque de extensiones y entrada del inodo
+#define ASSOOFS_ALLOC_CREDITS 4
+// Entradas de los dos inodos, indice y dos hojas, crecimiento del directorio o bloques de uno nuevo, mapa de inodos
+#define ASSOOFS_CREATE_CREDITS 17
+// Hoja del directorio y entradas de los dos inodos
+#define ASSOOFS_UNLINK_CREDITS 4
+// Entrada del inodo y mapa de inodos; los bloques se liberan ampliando el handle (assoofs_journal_ensure_credits)
+#define ASSOOFS_DELETE_CREDITS 2
+
+static inline handle_t *assoofs_journal_start(struct super_block *sb, int credits) {
+    journal_t *journal = ASSOOFS_SB(sb)->s_journal;
+
+    if (!journal)
+        return NULL;
+    return jbd2_journal_start(journal, credits);
+}
+
+static inline int assoofs_journal_stop(handle_t *handle) {
+    if (!handle)
+        return 0;
+    return jbd2_journal_stop(handle);
+}
+
+// Hay que pedirla antes de modificar un buffer de metadatos
+static int assoofs_journal_get_write_access(struct super_block *sb, struct buffer_head *bh) {
+    handle_t *handle = journal_current_handle();
+
+    if (!ASSOOFS_SB(sb)->s_journal)
+        return 0;
+    if (WARN_ON_ONCE(!handle))
+        return -EIO;
+    return jbd2_journal_get_write_access(handle, bh);
+}
+
+/*
+ * Anota en la transaccion un buffer de metadatos ya modificado. Sin diario se
+ * marca sucio y, si pertenece a un inodo, se asocia a el para fsync.
+ */
+static int assoofs_journal_dirty_metadata(struct super_block *sb, struct inode *inode, struct buffer_head *bh) {
+    if (!ASSOOFS_SB(sb)->s_journal) {
+        if (inode)
+            mark_buffer_dirty_inode(bh, inode);
+        else
+            mark_buffer_dirty(bh);
+        return 0;
+    }
+    return jbd2_journal_dirty_metadata(journal_current_handle(), bh);
+}
+
+/*
+ * Como assoofs_journal_get_write_access, para un bloque del mapa de bits en el
+ * que se van a liberar bloques: jbd2 guarda ademas una copia de como estaba en
+ * la ultima transaccion confirmada (b_committed_data), ver assoofs_find_free_run.
+ */
+static int assoofs_journal_get_undo_access(struct super_block *sb, struct buffer_head *bh) {
+    handle_t *handle = journal_current_handle();
+
+    if (!ASSOOFS_SB(sb)->s_journal)
+        return 0;
+    if (WARN_ON_ONCE(!handle))
+        return -EIO;
+    return jbd2_journal_get_undo_access(handle, bh);
+}
+
+/*
+ * Asegura que al handle abierto le quedan credits creditos y revokes registros
+ * de revocacion. Si la transaccion no puede crecer, se confirma lo hecho hasta
+ * ahora y el handle sigue en una nueva, asi que solo se llama sin cerrojos de
+ * pagina ni i_data_sem y donde lo ya hecho deja el volumen coherente.
+ */
+static int assoofs_journal_ensure_credits(struct super_block *sb, int credits, int revokes) {
+    handle_t *handle = journal_current_handle();
+    int ret;
+
+    if (!ASSOOFS_SB(sb)->s_journal)
+        return 0;
+    if (WARN_ON_ONCE(!handle))
+        return -EIO;
+    if (jbd2_handle_buffer_credits(handle) >= credits && handle->h_revoke_credits >= revokes)
+        return 0;
+    ret = jbd2_journal_extend(handle, credits, revokes);
+    if (ret <= 0)
+        return ret;
+    return jbd2__journal_restart(handle, credits, revokes, GFP_NOFS);
+}
+
+/*
+ * Olvida un bloque de metadatos que se va a liberar. Con diario se revoca:
+ * repetir el diario tras una caida no debe escribir su copia vieja cuando el
+ * bloque ya sea de otro. Sin diario basta con descartar su buffer sucio.
+ */
+static int assoofs_journal_forget(struct super_block *sb, uint64_t block) {
+    struct buffer_head *bh = sb_find_get_block(sb, block);
+    int ret;
+
+    if (!ASSOOFS_SB(sb)->s_journal) {
+        bforget(bh);
+        return 0;
+    }
+    ret = assoofs_journal_ensure_credits(sb, 1, 1);
+    if (ret) {
+        brelse(bh);
+        return ret;
+    }
+    return jbd2_journal_revoke(journal_current_handle(), block, bh); // Se queda con la referencia de bh
+}
+
+
+/*
+ *  Operaciones sobre ficheros
+ */
+
+
+int assoofs_sb_get_freeblocks(struct super_block *sb, uint64_t goal, uint64_t *block, uint32_t *count);
+
+int assoofs_sb_get_a_freeblock(struct super_block *sb, uint64_t goal, uint64_t *block);
+
+static int assoofs_new_blocks(struct inode *inode, uint32_t file_block, uint64_t *block, uint32_t *count);
+
+int assoofs_sb_free_blocks(struct super_block *sb, uint64_t block, uint32_t count);
+
+static int assoofs_file_mmap(struct file *file, struct vm_area_struct *vma);
+
+static int assoofs_fsync(struct file *file, loff_t start, loff_t end, int datasync);
+
+static ssize_t assoofs_file_read_iter(struct kiocb *iocb, struct iov_iter *to);
+
+static ssize_t assoofs_file_write_iter(struct kiocb *iocb, struct iov_iter *from);
+
+static int assoofs_file_open(struct inode *inode, struct file *file);
+
+static loff_t assoofs_file_llseek(struct file *file, loff_t offset, int whence);
+
+static long assoofs_fallocate(struct file *file, int mode, loff_t offset, loff_t len);
+
+// Los datos de los ficheros pasan por la cache de paginas (ver assoofs_aops), salvo con O_DIRECT
+const struct file_operations assoofs_file_operations = {
+    .open = assoofs_file_open,
+    .llseek = assoofs_file_llseek,
+    .read_iter = assoofs_file_read_iter,
+    .write_iter = assoofs_file_write_iter,
+    .iopoll = iomap_dio_iopoll,
+    .mmap = assoofs_file_mmap,
+    .splice_read = generic_file_splice_read,
+    .splice_write = iter_file_splice_write,
+    .fsync = assoofs_fsync,
+    .fallocate = assoofs_fallocate,
+};
+
+/*
+ *  Extensiones: lista ordenada de rangos contiguos (file_block, start_block, block_count)
+ */
+
+static unsigned int assoofs_max_extents(struct super_block *sb) {
+    return ASSOOFS_INODE_EXTENTS + sb->s_blocksize / sizeof(struct assoofs_extent);
+}
+
+/*
+ * Copia en list todas las extensiones del inodo: las del propio inodo y las del
+ * bloque de desbordamiento. list debe tener sitio para assoofs_max_extents().
+ */
+static int assoofs_read_extents(struct super_block *sb, struct assoofs_inode_info *inode_info, struct assoofs_extent *list) {
+    struct buffer_head *bh;
+    uint32_t inline_count = min_t(uint32_t, inode_info->extents_count, ASSOOFS_INODE_EXTENTS);
+
+    memcpy(list, inode_info->extents, inline_count * sizeof(*list));
+    if (inode_info->extents_count <= ASSOOFS_INODE_EXTENTS)
+        return 0;
+
+    bh = sb_bread(sb, inode_info->extent_block);
+    if (!bh)
+        return -EIO;
+    memcpy(list + ASSOOFS_INODE_EXTENTS, bh->b_data, (inode_info->extents_count - ASSOOFS_INODE_EXTENTS) * sizeof(*list));
+    brelse(bh);
+    return 0;
+}
+
+/*
+ * Bloque fisico por el que empezar a buscar sitio para el bloque logico
+ * file_block: el que le corresponderia si el fichero siguiera contiguo desde
+ * la extension anterior o, si no tiene ninguna, el principio del grupo de su
+ * inodo. El llamante tiene i_data_sem.
+ */
+static uint64_t assoofs_block_goal(struct inode *inode, uint32_t file_block) {
+    struct super_block *sb = inode->i_sb;
+    struct assoofs_inode_info *inode_info = &ASSOOFS_I(inode)->info;
+    struct assoofs_extent prev = { 0 }, *list;
+    struct buffer_head *bh;
+    uint32_t i, n;
+    uint64_t goal;
+
+    n = min_t(uint32_t, inode_info->extents_count, ASSOOFS_INODE_EXTENTS);
+    for (i = 0; i < n && inode_info->extents[i].file_block <= file_block; i++)
+        prev = inode_info->extents[i];
+    if (i == n && inode_info->extents_count > ASSOOFS_INODE_EXTENTS) {
+        bh = sb_bread(sb, inode_info->extent_block);
+        if (bh) {
+            list = (struct assoofs_extent *)bh->b_data;
+            n = inode_info->extents_count - ASSOOFS_INODE_EXTENTS;
+            for (i = 0; i < n && list[i].file_block <= file_block; i++)
+                prev = list[i];
+            brelse(bh);
+        }
+    }
+
+    if (prev.block_count) {
+        goal = prev.start_block + (file_block - prev.file_block);
+        if (goal < ASSOOFS_SB(sb)->s_asb->blocks_count)
+            return goal;
+    }
+    return assoofs_inode_group(sb, inode->i_ino) * ASSOOFS_SB(sb)->s_asb->blocks_per_group;
+}
+
+/*
+ * Escribe count extensiones de list en el inodo y, si no caben, en su bloque de
+ * desbordamiento (que se reserva la primera vez). El llamante marca el inodo
+ * como sucio; el bloque de desbordamiento queda asociado a el para fsync.
+ */
+static int assoofs_write_extents(struct inode *inode, struct assoofs_extent *list, uint32_t count) {
+    struct super_block *sb = inode->i_sb;
+    struct assoofs_inode_info *inode_info = &ASSOOFS_I(inode)->info;
+    struct buffer_head *bh;
+    uint32_t inline_count = min_t(uint32_t, count, ASSOOFS_INODE_EXTENTS);
+    int ret;
+
+    if (count > assoofs_max_extents(sb))
+        return -EFBIG;
+
+    if (count > ASSOOFS_INODE_EXTENTS) {
+        if (!inode_info->extent_block && assoofs_sb_get_a_freeblock(sb, assoofs_block_goal(inode, list[count - 1].file_block), &inode_info->extent_block))
+            return -ENOSPC;
+
+        bh = sb_bread(sb, inode_info->extent_block);
+        if (!bh)
+            return -EIO;
+        ret = assoofs_journal_get_write_access(sb, bh);
+        if (ret) {
+            brelse(bh);
+            return ret;
+        }
+        memset(bh->b_data, 0, sb->s_blocksize);
+        memcpy(bh->b_data, list + ASSOOFS_INODE_EXTENTS, (count - ASSOOFS_INODE_EXTENTS) * sizeof(*list));
+        ret = assoofs_journal_dirty_metadata(sb, inode, bh);
+        brelse(bh);
+        if (ret)
+            return ret;
+    }
+
+    memset(inode_info->extents, 0, sizeof(inode_info->extents));
+    memcpy(inode_info->extents, list, inline_count * sizeof(*list));
+    inode_info->extents_count = count;
+    return 0;
+}
+
+/*
+ * Busca la extension que contiene el bloque logico file_block. Devuelve -ENOENT
+ * si el bloque no tiene asignado ningun bloque fisico.
+ */
+int assoofs_get_extent(struct super_block *sb, struct assoofs_inode_info *inode_info, uint32_t file_block, struct assoofs_extent *extent) {
+    struct buffer_head *bh;
+    struct assoofs_extent *list;
+    uint32_t i, count;
+    int ret = -ENOENT;
+
+    count = min_t(uint32_t, inode_info->extents_count, ASSOOFS_INODE_EXTENTS);
+    for (i = 0; i < count; i++) {
+        list = &inode_info->extents[i];
+        if (file_block >= list->file_block && file_block - list->file_block < list->block_count) {
+            *extent = *list;
+            return 0;
+        }
+    }
+    if (inode_info->extents_count <= ASSOOFS_INODE_EXTENTS)
+        return -ENOENT;
+
+    bh = sb_bread(sb, inode_info->extent_block);
+    if (!bh)
+        return -EIO;
+    list = (struct assoofs_extent *)bh->b_data;
+    count = inode_info->extents_count - ASSOOFS_INODE_EXTENTS;
+    for (i = 0; i < count; i++, list++) {
+        if (file_block >= list->file_block && file_block - list->file_block < list->block_count) {
+            *extent = *list;
+            ret = 0;
+            break;
+        }
+    }
+    brelse(bh);
+    return ret;
+}
+
+/*
+ * Recorta *count para que el hueco que empieza en el bloque logico file_block
+ * (sin bloque fisico) no se meta en la siguiente extension.
+ */
+static int assoofs_hole_length(struct super_block *sb, struct assoofs_inode_info *inode_info, uint32_t file_block, uint32_t *count) {
+    struct buffer_head *bh;
+    struct assoofs_extent *list;
+    uint32_t i, n;
+
+    n = min_t(uint32_t, inode_info->extents_count, ASSOOFS_INODE_EXTENTS);
+    for (i = 0; i < n; i++) {
+        list = &inode_info->extents[i];
+        if (list->file_block > file_block && list->file_block - file_block < *count)
+            *count = list->file_block - file_block;
+    }
+    if (inode_info->extents_count <= ASSOOFS_INODE_EXTENTS)
+        return 0;
+
+    bh = sb_bread(sb, inode_info->extent_block);
+    if (!bh)
+        return -EIO;
+    list = (struct assoofs_extent *)bh->b_data;
+    n = inode_info->extents_count - ASSOOFS_INODE_EXTENTS;
+    for (i = 0; i < n; i++, list++) {
+        if (list->file_block > file_block && list->file_block - file_block < *count)
+            *count = list->file_block - file_block;
+    }
+    brelse(bh);
+    return 0;
+}
+
+/*
+ * Anade al inodo el rango [file_block, file_block + block_count) -> start_block,
+ * fusionandolo con las extensiones vecinas cuando son contiguas en disco.
+ */
+int assoofs_add_extent(struct inode *inode, uint32_t file_block, uint64_t start_block, uint32_t block_count) {
+    struct super_block *sb = inode->i_sb;
+    struct assoofs_inode_info *inode_info = &ASSOOFS_I(inode)->info;
+    struct assoofs_extent *list, *prev, *next;
+    uint32_t i, count = inode_info->extents_count;
+    int ret;
+
+    list = kmalloc_array(assoofs_max_extents(sb) + 1, sizeof(*list), GFP_KERNEL);
+    if (!list)
+        return -ENOMEM;
+    ret = assoofs_read_extents(sb, inode_info, list);
+    if (ret)
+        goto out;
+
+    for (i = 0; i < count && list[i].file_block < file_block; i++)
+        ;
+
+    prev = i > 0 ? &list[i - 1] : NULL;
+    next = i < count ? &list[i] : NULL;
+    if (prev && prev->file_block + prev->block_count == file_block && prev->start_block + prev->block_count == start_block) {
+        prev->block_count += block_count;
+        if (next && file_block + block_count == next->file_block && start_block + block_count == next->start_block) {
+            prev->block_count += next->block_count;
+            memmove(next, next + 1, (count - i - 1) * sizeof(*list));
+            count--;
+        }
+    } else if (next && file_block + block_count == next->file_block && start_block + block_count == next->start_block) {
+        next->file_block = file_block;
+        next->start_block = start_block;
+        next->block_count += block_count;
+    } else {
+        memmove(&list[i + 1], &list[i], (count - i) * sizeof(*list));
+        list[i].file_block = file_block;
+        list[i].start_block = start_block;
+        list[i].block_count = block_count;
+        count++;
+    }
+
+    ret = assoofs_write_extents(inode, list, count);
+out:
+    kfree(list);
+    return ret;
+}
+
+/*
+ * Quita del inodo los bloques logicos [first, first + count). En *freed (que
+ * libera el llamante) quedan los rangos de bloques fisicos que ocupaban; aun
+ * no se han devuelto al mapa de bits, ver assoofs_release_blocks. Una
+ * extension que contiene el rango entero se parte en dos.
+ */
+static int assoofs_remove_extents(struct inode *inode, uint32_t first, uint32_t count, struct assoofs_extent **freed, uint32_t *nfreed) {
+    struct super_block *sb = inode->i_sb;
+    struct assoofs_inode_info *inode_info = &ASSOOFS_I(inode)->info;
+    struct assoofs_extent *list, *keep, *e;
+    uint64_t end = (uint64_t)first + count, e_end, from, to;
+    uint32_t i, nkeep = 0;
+    int ret;
+
+    *freed = NULL;
+    *nfreed = 0;
+    list = kmalloc_array(assoofs_max_extents(sb), sizeof(*list), GFP_KERNEL);
+    keep = kmalloc_array(assoofs_max_extents(sb) + 1, sizeof(*keep), GFP_KERNEL);
+    *freed = kmalloc_array(max_t(uint32_t, inode_info->extents_count, 1), sizeof(**freed), GFP_KERNEL);
+    ret = -ENOMEM;
+    if (!list || !keep || !*freed)
+        goto out;
+    ret = assoofs_read_extents(sb, inode_info, list);
+    if (ret)
+        goto out;
+
+    for (i = 0; i < inode_info->extents_count; i++) {
+        e = &list[i];
+        e_end = (uint64_t)e->file_block + e->block_count;
+        if (e_end <= first || e->file_block >= end) {
+            keep[nkeep++] = *e;
+            continue;
+        }
+        from = max_t(uint64_t, e->file_block, first);
+        to = min(e_end, end);
+        if (e->file_block < from)
+            keep[nkeep++] = (struct assoofs_extent){ .file_block = e->file_block, .block_count = from - e->file_block, .start_block = e->start_block };
+        (*freed)[(*nfreed)++] = (struct assoofs_extent){ .file_block = from, .block_count = to - from, .start_block = e->start_block + (from - e->file_block) };
+        if (to < e_end)
+            keep[nkeep++] = (struct assoofs_extent){ .file_block = to, .block_count = e_end - to, .start_block = e->start_block + (to - e->file_block) };
+    }
+    if (*nfreed)
+        ret = assoofs_write_extents(inode, keep, nkeep);
+out:
+    if (ret) {
+        kfree(*freed);
+        *freed = NULL;
+        *nfreed = 0;
+    }
+    kfree(keep);
+    kfree(list);
+    return ret;
+}
+
+/*
+ * Numero de bloques logicos cubiertos por las extensiones del inodo (fin de la
+ * ultima extension).
+ */
+static int assoofs_file_blocks(struct super_block *sb, struct assoofs_inode_info *inode_info, uint32_t *blocks) {
+    struct assoofs_extent last;
+    struct buffer_head *bh;
+
+    if (!inode_info->extents_count) {
+        *blocks = 0;
+        return 0;
+    }
+
+    if (inode_info->extents_count <= ASSOOFS_INODE_EXTENTS) {
+        last = inode_info->extents[inode_info->extents_count - 1];
+    } else {
+        bh = sb_bread(sb, inode_info->extent_block);
+        if (!bh)
+            return -EIO;
+        last = ((struct assoofs_extent *)bh->b_data)[inode_info->extents_count - ASSOOFS_INODE_EXTENTS - 1];
+        brelse(bh);
+    }
+    *blocks = last.file_block + last.block_count;
+    return 0;
+}
+
+/*
+ * Reserva bloques para el fichero hasta cubrir blocks bloques logicos. Los
+ * bloques que faltan se piden de una vez y se anaden por el final de la lista
+ * de extensiones.
+ */
+static int assoofs_alloc_file_blocks(struct inode *inode, uint32_t blocks) {
+    struct super_block *sb = inode->i_sb;
+    uint32_t allocated, count;
+    uint64_t block;
+    int ret;
+
+    assoofs_down_write(inode->i_sb, &ASSOOFS_I(inode)->i_data_sem);
+    ret = assoofs_file_blocks(sb, &ASSOOFS_I(inode)->info, &allocated);
+    while (!ret && allocated < blocks) {
+        count = blocks - allocated;
+        ret = assoofs_new_blocks(inode, allocated, &block, &count);
+        if (ret)
+            break;
+        ret = assoofs_add_extent(inode, allocated, block, count);
+        if (ret) {
+            assoofs_sb_free_blocks(sb, block, count); // Aun no los ha visto nadie: se devuelven ya
+            break;
+        }
+        allocated += count;
+    }
+    up_write(&ASSOOFS_I(inode)->i_data_sem);
+    return ret;
+}
+
+/*
+ * Traduce el bloque logico iblock del fichero a su bloque fisico para la cache
+ * de paginas. Si el bloque esta asignado se devuelve tambien cuantos de los
+ * siguientes son contiguos en disco (hasta b_size), de modo que mpage construye
+ * peticiones grandes. Con create se reserva el bloque si era un hueco.
+ */
+static int assoofs_get_block(struct inode *inode, sector_t iblock, struct buffer_head *bh_result, int create) {
+    struct super_block *sb = inode->i_sb;
+    struct assoofs_inode_info *inode_info = &ASSOOFS_I(inode)->info;
+    struct assoofs_extent extent;
+    uint64_t max_blocks = bh_result->b_size >> inode->i_blkbits, block;
+    uint32_t count = 1;
+    u64 start = ktime_get_ns();
+    handle_t *handle;
+    int ret, err;
+
+    if (iblock >= U32_MAX)
+        return -EFBIG;
+    if (WARN_ON_ONCE(assoofs_has_inline_data(inode)))
+        return -EIO;
+
+    down_read(&ASSOOFS_I(inode)->i_data_sem);
+    ret = assoofs_get_extent(sb, inode_info, iblock, &extent);
+    up_read(&ASSOOFS_I(inode)->i_data_sem);
+    if (!ret)
+        goto mapped;
+    if (ret != -ENOENT || !create)
+        return ret == -ENOENT ? 0 : ret;
+
+    /*
+     * Normalmente ya hay un handle abierto (write_begin, page_mkwrite) y este
+     * solo se anida: no se puede empezar uno con la pagina bloqueada, porque
+     * la transaccion en curso podria estar esperando a quien quiere la pagina.
+     */
+    handle = assoofs_journal_start(sb, ASSOOFS_ALLOC_CREDITS);
+    if (IS_ERR(handle))
+        return PTR_ERR(handle);
+    assoofs_down_write(sb, &ASSOOFS_I(inode)->i_data_sem);
+
+    // Otro hilo (p.ej. la writeback) puede haber reservado el bloque mientras esperabamos
+    ret = assoofs_get_extent(sb, inode_info, iblock, &extent);
+    if (!ret) {
+        up_write(&ASSOOFS_I(inode)->i_data_sem);
+        assoofs_journal_stop(handle);
+        goto mapped;
+    }
+    if (ret == -ENOENT) {
+        ret = assoofs_new_blocks(inode, iblock, &block, &count);
+        if (!ret) {
+            ret = assoofs_add_extent(inode, iblock, block, 1);
+            if (ret)
+                assoofs_sb_free_blocks(sb, block, 1);
+        }
+    }
+
+    up_write(&ASSOOFS_I(inode)->i_data_sem);
+    if (!ret)
+        mark_inode_dirty(inode);
+    err = assoofs_journal_stop(handle);
+    if (!ret)
+        ret = err;
+    if (ret)
+        return ret;
+
+    map_bh(bh_result, sb, block);
+    set_buffer_new(bh_result);
+    bh_result->b_size = sb->s_blocksize;
+    trace_assoofs_get_block(inode, iblock, create, block, 1, true);
+    assoofs_hist_since(sb, ASSOOFS_HIST_GET_BLOCK, start);
+    return 0;
+
+mapped:
+    max_blocks = min_t(uint64_t, max_blocks, extent.file_block + extent.block_count - iblock);
+    map_bh(bh_result, sb, extent.start_block + (iblock - extent.file_block));
+    bh_result->b_size = max_blocks << inode->i_blkbits;
+    trace_assoofs_get_block(inode, iblock, create, bh_result->b_blocknr, max_blocks, false);
+    assoofs_hist_since(sb, ASSOOFS_HIST_GET_BLOCK, start);
+    return 0;
+}
+
+/*
+ *  Datos en linea: un fichero de hasta ASSOOFS_INLINE_DATA_MAX bytes vive en
+ *  inline_data de su inodo. Su unica pagina se rellena y se vuelca copiando de y
+ *  a la entrada en memoria, sin pasar por get_block ni leer bloques de datos.
+ */
+
+static void assoofs_read_inline_page(struct inode *inode, struct page *page) {
+    struct assoofs_inode *ai = ASSOOFS_I(inode);
+    size_t size = 0;
+    void *kaddr;
+
+    if (page->index == 0) {
+        down_read(&ai->i_data_sem);
+        size = min_t(loff_t, i_size_read(inode), ASSOOFS_INLINE_DATA_MAX);
+        kaddr = kmap_atomic(page);
+        memcpy(kaddr, ai->info.inline_data, size);
+        kunmap_atomic(kaddr);
+        up_read(&ai->i_data_sem);
+    }
+    zero_user_segment(page, size, PAGE_SIZE);
+    SetPageUptodate(page);
+}
+
+/*
+ * Pasa los datos en linea a un bloque propio cuando el fichero va a superar
+ * ASSOOFS_INLINE_DATA_MAX. El bloque se reserva ya, dentro del handle del
+ * llamante, pero los datos se quedan en la pagina 0 del fichero, que queda
+ * sucia: la escribe la writeback por get_block como cualquier otra.
+ */
+static int assoofs_convert_inline_data(struct inode *inode) {
+    struct super_block *sb = inode->i_sb;
+    struct assoofs_inode *ai = ASSOOFS_I(inode);
+    struct page *page;
+    uint64_t block = 0;
+    uint32_t count = 1;
+    void *kaddr;
+    loff_t size;
+    int ret = 0;
+
+    if (!assoofs_has_inline_data(inode))
+        return 0;
+    // La pagina se bloquea antes que i_data_sem, como en writepage
+    page = find_or_create_page(inode->i_mapping, 0, mapping_gfp_constraint(inode->i_mapping, ~__GFP_FS));
+    if (!page)
+        return -ENOMEM;
+    assoofs_down_write(sb, &ai->i_data_sem);
+    if (!(ai->info.flags & ASSOOFS_INODE_INLINE_DATA))
+        goto out;
+
+    size = min_t(loff_t, i_size_read(inode), ASSOOFS_INLINE_DATA_MAX);
+    if (size) {
+        ret = assoofs_new_blocks(inode, 0, &block, &count);
+        if (ret)
+            goto out;
+        clean_bdev_aliases(sb->s_bdev, block, 1); // Por si el bloque fue de metadatos y sigue en la cache del dispositivo
+    }
+    // Una pagina al dia tiene ya lo ultimo: write_end y writepage copian de ella a inline_data
+    if (!PageUptodate(page)) {
+        kaddr = kmap_atomic(page);
+        memcpy(kaddr, ai->info.inline_data, size);
+        kunmap_atomic(kaddr);
+        zero_user_segment(page, size, PAGE_SIZE);
+        SetPageUptodate(page);
+    }
+
+    ai->info.flags &= ~ASSOOFS_INODE_INLINE_DATA;
+    memset(ai->info.inline_data, 0, ASSOOFS_INLINE_DATA_MAX);
+    ai->info.extents_count = 0;
+    if (!size)
+        goto out;
+    ret = assoofs_add_extent(inode, 0, block, 1);
+    if (ret) {
+        // Los datos siguen en la pagina: vuelven a inline_data y el bloque, que nadie ha visto, se devuelve
+        assoofs_sb_free_blocks(sb, block, 1);
+        kaddr = kmap_atomic(page);
+        memcpy(ai->info.inline_data, kaddr, size);
+        kunmap_atomic(kaddr);
+        ai->info.flags |= ASSOOFS_INODE_INLINE_DATA;
+        goto out;
+    }
+    if (!page_has_buffers(page))
+        create_empty_buffers(page, sb->s_blocksize, 0);
+    set_page_dirty(page);
+out:
+    up_write(&ai->i_data_sem);
+    unlock_page(page);
+    put_page(page);
+    if (!ret)
+        mark_inode_dirty(inode);
+    return ret;
+}
+
+static int assoofs_write_inline_end(struct inode *inode, loff_t pos, unsigned copied, struct page *page) {
+    struct assoofs_inode *ai = ASSOOFS_I(inode);
+    void *kaddr;
+
+    assoofs_down_write(inode->i_sb, &ai->i_data_sem); // Antes de kmap_atomic: puede dormir
+    kaddr = kmap_atomic(page);
+    memcpy(ai->info.inline_data + pos, kaddr + pos, copied);
+    kunmap_atomic(kaddr);
+    up_write(&ai->i_data_sem);
+
+    if (pos + copied > inode->i_size)
+        i_size_write(inode, pos + copied);
+    unlock_page(page);
+    put_page(page);
+
+    mark_inode_dirty(inode); // La pagina queda limpia: lo que se escribe es el inodo
+    return copied;
+}
+
+static int assoofs_readpage(struct file *file, struct page *page) {
+    trace_assoofs_readpage(page->mapping->host, page->index, 1);
+    assoofs_stat_inc(page->mapping->host->i_sb, ASSOOFS_STAT_DATA_READS);
+    if (assoofs_has_inline_data(page->mapping->host)) {
+        assoofs_read_inline_page(page->mapping->host, page);
+        unlock_page(page);
+        return 0;
+    }
+    return mpage_readpage(page, assoofs_get_block);
+}
+
+static void assoofs_readahead(struct readahead_control *rac) {
+    struct inode *inode = rac->mapping->host;
+
+    // Sin readahead para datos en linea: la unica pagina la rellena readpage
+    if (assoofs_has_inline_data(inode))
+        return;
+    trace_assoofs_readahead(inode, readahead_index(rac), readahead_count(rac));
+    assoofs_stat_add(inode->i_sb, ASSOOFS_STAT_DATA_READS, readahead_count(rac));
+    mpage_readahead(rac, assoofs_get_block);
+}
+
+static int assoofs_writepage(struct page *page, struct writeback_control *wbc) {
+    struct inode *inode = page->mapping->host;
+    struct assoofs_inode *ai = ASSOOFS_I(inode);
+    size_t size = 0;
+    void *kaddr;
+
+    trace_assoofs_writepage(inode, page->index, 1);
+    assoofs_stat_inc(inode->i_sb, ASSOOFS_STAT_DATA_WRITES);
+    if (!assoofs_has_inline_data(inode))
+        return block_write_full_page(page, assoofs_get_block, wbc);
+
+    // Pagina ensuciada por mmap: sus datos vuelven a inline_data
+    if (page->index == 0) {
+        size = min_t(loff_t, i_size_read(inode), ASSOOFS_INLINE_DATA_MAX);
+        assoofs_down_write(inode->i_sb, &ai->i_data_sem);
+        kaddr = kmap_atomic(page);
+        memcpy(ai->info.inline_data, kaddr, size);
+        kunmap_atomic(kaddr);
+        up_write(&ai->i_data_sem);
+        mark_inode_dirty(inode);
+    }
+    unlock_page(page);
+    return 0;
+}
+
+static int assoofs_writepages(struct address_space *mapping, struct writeback_control *wbc) {
+    long nr_to_write = wbc->nr_to_write;
+    int ret;
+
+    if (assoofs_has_inline_data(mapping->host))
+        return generic_writepages(mapping, wbc);
+    ret = mpage_writepages(mapping, wbc, assoofs_get_block);
+    trace_assoofs_writepages(mapping->host, 0, nr_to_write - wbc->nr_to_write);
+    assoofs_stat_add(mapping->host->i_sb, ASSOOFS_STAT_DATA_WRITES, nr_to_write - wbc->nr_to_write);
+    return ret;
+}
+
+// Creditos para escribir una pagina: una reserva por bloque y la posible salida de inline_data
+static inline int assoofs_page_credits(struct inode *inode) {
+    return ASSOOFS_ALLOC_CREDITS * (1 + (PAGE_SIZE >> inode->i_blkbits));
+}
+
+/*
+ * El handle se abre antes de bloquear la pagina y sigue abierto hasta
+ * write_end, de modo que las reservas de get_block se anidan en el.
+ */
+static int assoofs_write_begin(struct file *file, struct address_space *mapping, loff_t pos, unsigned len, unsigned flags, struct page **pagep, void **fsdata) {
+    struct inode *inode = mapping->host;
+    struct page *page;
+    handle_t *handle;
+    int ret;
+
+    handle = assoofs_journal_start(inode->i_sb, assoofs_page_credits(inode));
+    if (IS_ERR(handle))
+        return PTR_ERR(handle);
+
+    if (assoofs_has_inline_data(inode)) {
+        if (pos + len <= ASSOOFS_INLINE_DATA_MAX) {
+            page = grab_cache_page_write_begin(mapping, 0, flags);
+            if (!page) {
+                ret = -ENOMEM;
+                goto out_stop;
+            }
+            if (!PageUptodate(page))
+                assoofs_read_inline_page(inode, page);
+            *pagep = page;
+            return 0;
+        }
+        ret = assoofs_convert_inline_data(inode);
+        if (ret)
+            goto out_stop;
+    }
+
+    ret = block_write_begin(mapping, pos, len, flags, pagep, assoofs_get_block);
+    if (ret >= 0)
+        return ret;
+    if (pos + len > inode->i_size)
+        truncate_pagecache(inode, inode->i_size);
+out_stop:
+    assoofs_journal_stop(handle);
+    return ret;
+}
+
+static int assoofs_write_end(struct file *file, struct address_space *mapping, loff_t pos, unsigned len, unsigned copied, struct page *page, void *fsdata) {
+    struct inode *inode = mapping->host;
+    handle_t *handle = ASSOOFS_SB(inode->i_sb)->s_journal ? journal_current_handle() : NULL;
+    int ret, err;
+
+    if (assoofs_has_inline_data(inode))
+        ret = assoofs_write_inline_end(inode, pos, copied, page);
+    else
+        ret = generic_write_end(file, mapping, pos, len, copied, page, fsdata);
+    err = assoofs_journal_stop(handle); // El de write_begin
+    return err ? err : ret;
+}
+
+/*
+ * Primera escritura en una pagina proyectada con mmap: se reservan aqui sus
+ * bloques, con el handle abierto antes de bloquear la pagina, para que la
+ * writeback no tenga que reservar nada. Un fichero con datos en linea pasa a
+ * bloques, porque la pagina ya no se puede copiar a inline_data en cada
+ * escritura.
+ */
+static vm_fault_t assoofs_page_mkwrite(struct vm_fault *vmf) {
+    struct inode *inode = file_inode(vmf->vma->vm_file);
+    struct super_block *sb = inode->i_sb;
+    handle_t *handle;
+    vm_fault_t ret;
+    int err;
+
+    sb_start_pagefault(sb);
+    file_update_time(vmf->vma->vm_file);
+    handle = assoofs_journal_start(sb, assoofs_page_credits(inode));
+    if (IS_ERR(handle)) {
+        ret = VM_FAULT_SIGBUS;
+        goto out;
+    }
+    err = assoofs_convert_inline_data(inode);
+    if (err)
+        ret = block_page_mkwrite_return(err);
+    else
+        ret = block_page_mkwrite_return(block_page_mkwrite(vmf->vma, vmf, assoofs_get_block));
+    assoofs_journal_stop(handle);
+out:
+    sb_end_pagefault(sb);
+    return ret;
+}
+
+// Saca los datos de inline_data fuera de write_begin y page_mkwrite, que ya tienen su handle
+static int assoofs_leave_inline_data(struct inode *inode) {
+    handle_t *handle;
+    int ret, err;
+
+    if (!assoofs_has_inline_data(inode))
+        return 0;
+    handle = assoofs_journal_start(inode->i_sb, assoofs_page_credits(inode));
+    if (IS_ERR(handle))
+        return PTR_ERR(handle);
+    ret = assoofs_convert_inline_data(inode);
+    err = assoofs_journal_stop(handle);
+    return ret ? ret : err;
+}
+
+static const struct vm_operations_struct assoofs_file_vm_ops = {
+    .fault = filemap_fault,
+    .map_pages = filemap_map_pages,
+    .page_mkwrite = assoofs_page_mkwrite,
+};
+
+static int assoofs_file_mmap(struct file *file, struct vm_area_struct *vma) {
+    file_accessed(file);
+    vma->vm_ops = &assoofs_file_vm_ops;
+    return 0;
+}
+
+/*
+ * Con diario basta con escribir los datos y esperar a la transaccion que
+ * modifico el inodo por ultima vez: con ella van sus bloques, sus extensiones
+ * y la entrada de directorio que lo creo.
+ */
+static int assoofs_fsync(struct file *file, loff_t start, loff_t end, int datasync) {
+    struct inode *inode = file->f_mapping->host;
+    journal_t *journal = ASSOOFS_SB(inode->i_sb)->s_journal;
+    int ret;
+
+    if (!journal)
+        return generic_file_fsync(file, start, end, datasync);
+    ret = file_write_and_wait_range(file, start, end);
+    if (ret)
+        return ret;
+    return jbd2_complete_transaction(journal, READ_ONCE(ASSOOFS_I(inode)->i_sync_tid));
+}
+
+static sector_t assoofs_bmap(struct address_space *mapping, sector_t block) {
+    if (assoofs_has_inline_data(mapping->host))
+        return 0;
+    return generic_block_bmap(mapping, block, assoofs_get_block);
+}
+
+/*
+ *  O_DIRECT: iomap lleva los datos entre el buffer del usuario y los bloques
+ *  del fichero sin pasar por la cache de paginas. assoofs_iomap_begin hace para
+ *  iomap lo que assoofs_get_block para la cache: traducir un rango del fichero
+ *  a una racha de bloques contiguos en disco, reservandola si es un hueco y se
+ *  va a escribir. Los ficheros con datos en linea no tienen bloques que leer:
+ *  sus lecturas O_DIRECT se hacen por la cache, y la primera escritura que no
+ *  cabe en inline_data los pasa a un bloque.
+ *
+ *  Con IOCB_NOWAIT (io_uring, RWF_NOWAIT) nada de esto espera: si hace falta
+ *  un cerrojo ocupado, leer metadatos del disco o reservar bloques se devuelve
+ *  -EAGAIN y el llamante lo reintenta desde un hilo que si puede bloquearse.
+ *  Las peticiones asincronas terminan desde la interrupcion del disco, salvo
+ *  las que tienen que esperar (ver assoofs_file_write_iter).
+ */
+
+/*
+ * Con IOMAP_NOWAIT no se puede leer del disco: las extensiones que no caben
+ * en el inodo solo se consultan si su bloque ya esta en memoria.
+ */
+static bool assoofs_extents_cached(struct super_block *sb, struct assoofs_inode_info *inode_info) {
+    struct buffer_head *bh;
+    bool cached;
+
+    if (inode_info->extents_count <= ASSOOFS_INODE_EXTENTS)
+        return true;
+    bh = sb_find_get_block(sb, inode_info->extent_block);
+    cached = bh && buffer_uptodate(bh);
+    brelse(bh);
+    return cached;
+}
+
+static int assoofs_iomap_begin(struct inode *inode, loff_t offset, loff_t length, unsigned flags, struct iomap *iomap, struct iomap *srcmap) {
+    struct super_block *sb = inode->i_sb;
+    struct assoofs_inode *ai = ASSOOFS_I(inode);
+    struct assoofs_extent extent;
+    uint64_t first = offset >> inode->i_blkbits;
+    uint64_t last = (offset + length - 1) >> inode->i_blkbits;
+    uint64_t block;
+    uint32_t count;
+    u64 start = ktime_get_ns();
+    handle_t *handle;
+    int ret, err;
+
+    if (last >= U32_MAX)
+        return -EFBIG;
+    if (WARN_ON_ONCE(assoofs_has_inline_data(inode)))
+        return -EIO;
+
+    iomap->bdev = sb->s_bdev;
+    iomap->offset = first << inode->i_blkbits;
+    iomap->flags = 0;
+    count = min_t(uint64_t, last - first + 1, U32_MAX);
+
+    if (flags & IOMAP_NOWAIT) {
+        if (!down_read_trylock(&ai->i_data_sem))
+            return -EAGAIN;
+        if (!assoofs_extents_cached(sb, &ai->info)) {
+            up_read(&ai->i_data_sem);
+            return -EAGAIN;
+        }
+    } else {
+        down_read(&ai->i_data_sem);
+    }
+    ret = assoofs_get_extent(sb, &ai->info, first, &extent);
+    if (ret == -ENOENT && !(flags & IOMAP_WRITE)) {
+        ret = assoofs_hole_length(sb, &ai->info, first, &count);
+        up_read(&ai->i_data_sem);
+        if (ret)
+            return ret;
+        // Los huecos se leen como ceros
+        iomap->type = IOMAP_HOLE;
+        iomap->addr = IOMAP_NULL_ADDR;
+        iomap->length = (u64)count << inode->i_blkbits;
+        return 0;
+    }
+    up_read(&ai->i_data_sem);
+    if (!ret)
+        goto mapped;
+    if (ret != -ENOENT)
+        return ret;
+    // Reservar lee el mapa de bits y espera al diario
+    if (flags & IOMAP_NOWAIT)
+        return -EAGAIN;
+
+    // Se reserva la racha entera de una vez; si el hueco es mas largo que ella, iomap vuelve a llamar
+    handle = assoofs_journal_start(sb, ASSOOFS_ALLOC_CREDITS);
+    if (IS_ERR(handle))
+        return PTR_ERR(handle);
+    assoofs_down_write(sb, &ai->i_data_sem);
+    ret = assoofs_get_extent(sb, &ai->info, first, &extent);
+    if (!ret) {
+        up_write(&ai->i_data_sem);
+        assoofs_journal_stop(handle);
+        goto mapped;
+    }
+    if (ret == -ENOENT)
+        ret = assoofs_hole_length(sb, &ai->info, first, &count);
+    if (!ret)
+        ret = assoofs_new_blocks(inode, first, &block, &count);
+    if (!ret) {
+        ret = assoofs_add_extent(inode, first, block, count);
+        if (ret)
+            assoofs_sb_free_blocks(sb, block, count); // Aun no los ha visto nadie: se devuelven ya
+    }
+    up_write(&ai->i_data_sem);
+    if (!ret)
+        mark_inode_dirty(inode);
+    err = assoofs_journal_stop(handle);
+    if (!ret)
+        ret = err;
+    if (ret)
+        return ret;
+
+    // IOMAP_F_NEW: iomap pone a cero la parte de los bloques nuevos que la escritura no cubre
+    iomap->type = IOMAP_MAPPED;
+    iomap->flags |= IOMAP_F_NEW;
+    iomap->addr = block << inode->i_blkbits;
+    iomap->length = (u64)count << inode->i_blkbits;
+    trace_assoofs_get_block(inode, first, 1, block, count, true);
+    assoofs_hist_since(sb, ASSOOFS_HIST_GET_BLOCK, start);
+    return 0;
+
+mapped:
+    count = min_t(uint64_t, count, extent.file_block + extent.block_count - first);
+    block = extent.start_block + (first - extent.file_block);
+    iomap->type = IOMAP_MAPPED;
+    iomap->addr = block << inode->i_blkbits;
+    iomap->length = (u64)count << inode->i_blkbits;
+    trace_assoofs_get_block(inode, first, !!(flags & IOMAP_WRITE), block, count, false);
+    assoofs_hist_since(sb, ASSOOFS_HIST_GET_BLOCK, start);
+    return 0;
+}
+
+static const struct iomap_ops assoofs_iomap_ops = {
+    .iomap_begin = assoofs_iomap_begin,
+};
+
+/*
+ * El tamano del fichero crece cuando los datos ya estan en disco: antes de eso,
+ * los bloques nuevos mas alla del final aun tienen lo que hubiera en ellos.
+ */
+static int assoofs_dio_write_end_io(struct kiocb *iocb, ssize_t size, int error, unsigned flags) {
+    struct inode *inode = file_inode(iocb->ki_filp);
+
+    if (error)
+        return error;
+    if (size && iocb->ki_pos + size > i_size_read(inode)) {
+        i_size_write(inode, iocb->ki_pos + size);
+        mark_inode_dirty(inode);
+    }
+    return 0;
+}
+
+static const struct iomap_dio_ops assoofs_dio_write_ops = {
+    .end_io = assoofs_dio_write_end_io,
+};
+
+static int assoofs_file_open(struct inode *inode, struct file *file) {
+    // Lecturas por la cache con IOCB_NOWAIT/IOCB_WAITQ y O_DIRECT sin bloqueos: ver assoofs_file_read_iter
+    file->f_mode |= FMODE_NOWAIT | FMODE_BUF_RASYNC;
+    return generic_file_open(inode, file);
+}
+
+static ssize_t assoofs_file_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+    struct inode *inode = file_inode(iocb->ki_filp);
+    ssize_t ret;
+
+    if (!(iocb->ki_flags & IOCB_DIRECT))
+        return generic_file_read_iter(iocb, to);
+    if (!iov_iter_count(to))
+        return 0;
+
+    // Compartido: excluye a las escrituras, que pueden sacar los datos de inline_data
+    if (iocb->ki_flags & IOCB_NOWAIT) {
+        if (!inode_trylock_shared(inode))
+            return -EAGAIN;
+    } else {
+        inode_lock_shared(inode);
+    }
+    if (assoofs_has_inline_data(inode)) {
+        inode_unlock_shared(inode);
+        iocb->ki_flags &= ~IOCB_DIRECT;
+        return generic_file_read_iter(iocb, to);
+    }
+    assoofs_stat_inc(inode->i_sb, ASSOOFS_STAT_DIO_READS);
+    ret = iomap_dio_rw(iocb, to, &assoofs_iomap_ops, NULL, is_sync_kiocb(iocb));
+    inode_unlock_shared(inode);
+    file_accessed(iocb->ki_filp);
+    return ret;
+}
+
+/*
+ * Si iomap no ha podido invalidar la cache de paginas del rango (p.ej. por un
+ * mmap), la escritura se hace por la cache, que luego se vuelca y se descarta
+ * como si hubiera sido directa.
+ */
+static ssize_t assoofs_dio_write_fallback(struct kiocb *iocb, struct iov_iter *from) {
+    struct address_space *mapping = iocb->ki_filp->f_mapping;
+    loff_t pos = iocb->ki_pos;
+    ssize_t written;
+    int ret;
+
+    written = generic_perform_write(iocb->ki_filp, from, pos);
+    if (written <= 0)
+        return written;
+    iocb->ki_pos += written;
+    ret = filemap_write_and_wait_range(mapping, pos, pos + written - 1);
+    if (ret)
+        return ret;
+    invalidate_mapping_pages(mapping, pos >> PAGE_SHIFT, (pos + written - 1) >> PAGE_SHIFT);
+    return written;
+}
+
+static ssize_t assoofs_file_write_iter(struct kiocb *iocb, struct iov_iter *from) {
+    struct file *file = iocb->ki_filp;
+    struct inode *inode = file_inode(file);
+    ssize_t ret;
+    bool wait;
+
+    if (!(iocb->ki_flags & IOCB_DIRECT)) {
+        // Una escritura por la cache puede reservar bloques y esperar al diario
+        if (iocb->ki_flags & IOCB_NOWAIT)
+            return -EAGAIN;
+        return generic_file_write_iter(iocb, from);
+    }
+
+    if (iocb->ki_flags & IOCB_NOWAIT) {
+        if (!inode_trylock(inode))
+            return -EAGAIN;
+    } else {
+        inode_lock(inode);
+    }
+    ret = generic_write_checks(iocb, from);
+    if (ret <= 0)
+        goto out;
+    if ((iocb->ki_flags & IOCB_NOWAIT) && assoofs_has_inline_data(inode)) {
+        ret = -EAGAIN;
+        goto out;
+    }
+    ret = file_modified(file);
+    if (ret)
+        goto out;
+
+    if (assoofs_has_inline_data(inode)) {
+        // Si todavia cabe en inline_data no hay bloque al que escribir
+        if (iocb->ki_pos + iov_iter_count(from) <= ASSOOFS_INLINE_DATA_MAX) {
+            iocb->ki_flags &= ~IOCB_DIRECT;
+            ret = generic_perform_write(file, from, iocb->ki_pos);
+            if (ret > 0)
+                iocb->ki_pos += ret;
+            goto out;
+        }
+        ret = assoofs_leave_inline_data(inode);
+        if (ret)
+            goto out;
+    }
+
+    /*
+     * Las escrituras que alargan el fichero terminan aqui, con el i_rwsem
+     * tomado: end_io actualiza i_size y dos que terminaran a la vez podrian
+     * dejarlo mal. Tambien las que no cubren bloques enteros, porque iomap
+     * rellena con ceros el resto de un bloque nuevo y eso no puede cruzarse
+     * con otra escritura al mismo bloque, ni con las que siguen en vuelo.
+     */
+    wait = is_sync_kiocb(iocb) || iocb->ki_pos + iov_iter_count(from) > i_size_read(inode);
+    if ((iocb->ki_pos | iov_iter_count(from)) & (i_blocksize(inode) - 1)) {
+        if ((iocb->ki_flags & IOCB_NOWAIT) && atomic_read(&inode->i_dio_count)) {
+            ret = -EAGAIN;
+            goto out;
+        }
+        inode_dio_wait(inode);
+        wait = true;
+    }
+    assoofs_stat_inc(inode->i_sb, ASSOOFS_STAT_DIO_WRITES);
+    ret = iomap_dio_rw(iocb, from, &assoofs_iomap_ops, &assoofs_dio_write_ops, wait);
+    if (ret == -ENOTBLK)
+        ret = assoofs_dio_write_fallback(iocb, from);
+out:
+    inode_unlock(inode);
+    if (ret > 0)
+        ret = generic_write_sync(iocb, ret);
+    return ret;
+}
+
+/*
+ *  Ficheros dispersos: un bloque logico sin extension es un hueco, se lee como
+ *  ceros y no ocupa disco. fallocate reserva bloques por adelantado en rachas
+ *  contiguas o los devuelve (FALLOC_FL_PUNCH_HOLE), y SEEK_HOLE/SEEK_DATA
+ *  recorren las extensiones con assoofs_iomap_begin sin leer los huecos.
+ */
+
+static loff_t assoofs_file_llseek(struct file *file, loff_t offset, int whence) {
+    struct inode *inode = file->f_mapping->host;
+
+    if (whence != SEEK_HOLE && whence != SEEK_DATA)
+        return generic_file_llseek(file, offset, whence);
+
+    // Excluye a las escrituras, que reservan bloques y sacan los datos de inline_data
+    inode_lock_shared(inode);
+    if (assoofs_has_inline_data(inode)) {
+        inode_unlock_shared(inode);
+        return generic_file_llseek(file, offset, whence); // Todo el fichero son datos
+    }
+    if (whence == SEEK_HOLE)
+        offset = iomap_seek_hole(inode, offset, &assoofs_iomap_ops);
+    else
+        offset = iomap_seek_data(inode, offset, &assoofs_iomap_ops);
+    inode_unlock_shared(inode);
+    if (offset < 0)
+        return offset;
+    return vfs_setpos(file, offset, inode->i_sb->s_maxbytes);
+}
+
+/*
+ * Devuelve al mapa de bits, dentro del handle abierto, los bloques que el
+ * inodo acaba de soltar (que ya no estan en sus extensiones). No se vuelven a
+ * reservar hasta que se confirme la transaccion, ver assoofs_find_free_run. Los
+ * de un directorio son metadatos y ademas se revocan.
+ */
+static int assoofs_release_blocks(struct inode *inode, struct assoofs_extent *freed, uint32_t count, bool metadata) {
+    struct super_block *sb = inode->i_sb;
+    uint32_t i, j;
+    int ret;
+
+    for (i = 0; i < count; i++) {
+        for (j = 0; metadata && j < freed[i].block_count; j++) {
+            ret = assoofs_journal_forget(sb, freed[i].start_block + j);
+            if (ret)
+                return ret;
+        }
+        ret = assoofs_sb_free_blocks(sb, freed[i].start_block, freed[i].block_count);
+        if (ret)
+            return ret;
+    }
+    return 0;
+}
+
+/*
+ * Pone a cero [pos, pos + len) por la cache de paginas, sin pasar de i_size ni
+ * tocar los huecos. Es para los trozos de bloque que quedan en los bordes de
+ * un FALLOC_FL_PUNCH_HOLE.
+ */
+static int assoofs_zero_range(struct inode *inode, loff_t pos, loff_t len) {
+    struct address_space *mapping = inode->i_mapping;
+    struct assoofs_inode *ai = ASSOOFS_I(inode);
+    struct assoofs_extent extent;
+    loff_t end = min_t(loff_t, pos + len, i_size_read(inode));
+    unsigned int n;
+    struct page *page;
+    void *fsdata;
+    int ret;
+
+    while (pos < end) {
+        n = min_t(loff_t, end - pos, PAGE_SIZE - offset_in_page(pos));
+        n = min_t(loff_t, n, i_blocksize(inode) - (pos & (i_blocksize(inode) - 1)));
+
+        down_read(&ai->i_data_sem);
+        ret = assoofs_get_extent(inode->i_sb, &ai->info, pos >> inode->i_blkbits, &extent);
+        up_read(&ai->i_data_sem);
+        if (ret && ret != -ENOENT)
+            return ret;
+        if (!ret) {
+            ret = pagecache_write_begin(NULL, mapping, pos, n, 0, &page, &fsdata);
+            if (ret)
+                return ret;
+            zero_user(page, offset_in_page(pos), n);
+            ret = pagecache_write_end(NULL, mapping, pos, n, n, page, fsdata);
+            if (ret < 0)
+                return ret;
+        }
+        pos += n;
+    }
+    return 0;
+}
+
+static int assoofs_punch_hole(struct inode *inode, loff_t offset, loff_t len) {
+    struct super_block *sb = inode->i_sb;
+    struct assoofs_extent *freed;
+    uint32_t nfreed;
+    loff_t end = offset + len;
+    loff_t first = round_up(offset, i_blocksize(inode));
+    loff_t last = round_down(end, i_blocksize(inode));
+    handle_t *handle;
+    int ret, err;
+
+    // Los bloques que el hueco no cubre enteros se quedan, con su parte a cero
+    if (first >= last)
+        return assoofs_zero_range(inode, offset, len);
+    ret = assoofs_zero_range(inode, offset, first - offset);
+    if (!ret)
+        ret = assoofs_zero_range(inode, last, end - last);
+    if (ret)
+        return ret;
+
+    truncate_pagecache_range(inode, first, last - 1);
+    handle = assoofs_journal_start(sb, ASSOOFS_ALLOC_CREDITS);
+    if (IS_ERR(handle))
+        return PTR_ERR(handle);
+    assoofs_down_write(sb, &ASSOOFS_I(inode)->i_data_sem);
+    ret = assoofs_remove_extents(inode, first >> inode->i_blkbits, (last - first) >> inode->i_blkbits, &freed, &nfreed);
+    up_write(&ASSOOFS_I(inode)->i_data_sem);
+    if (!ret) {
+        inode->i_mtime = inode->i_ctime = current_time(inode);
+        mark_inode_dirty(inode);
+        // Un fallo de pagina por mmap puede haber vuelto a leer el rango con los bloques viejos
+        truncate_pagecache_range(inode, first, last - 1);
+        ret = assoofs_release_blocks(inode, freed, nfreed, false);
+        kfree(freed);
+    }
+    err = assoofs_journal_stop(handle);
+    return ret ? ret : err;
+}
+
+/*
+ * Cambia el tamano de un fichero. Al crecer no se reserva nada (el final queda
+ * como hueco); al encoger se pone a cero lo que sobra del ultimo bloque y se
+ * devuelven los bloques que quedan enteros fuera.
+ */
+static int assoofs_truncate(struct inode *inode, loff_t size) {
+    struct super_block *sb = inode->i_sb;
+    struct assoofs_inode *ai = ASSOOFS_I(inode);
+    struct assoofs_extent *freed;
+    uint64_t first = (size + i_blocksize(inode) - 1) >> inode->i_blkbits;
+    uint32_t nfreed;
+    handle_t *handle;
+    int ret, err;
+
+    inode_dio_wait(inode);
+    if (size >= i_size_read(inode)) {
+        truncate_setsize(inode, size);
+        return 0;
+    }
+
+    if (assoofs_has_inline_data(inode)) {
+        assoofs_down_write(sb, &ai->i_data_sem);
+        if (size < ASSOOFS_INLINE_DATA_MAX)
+            memset(ai->info.inline_data + size, 0, ASSOOFS_INLINE_DATA_MAX - size);
+        up_write(&ai->i_data_sem);
+        truncate_setsize(inode, size);
+        return 0;
+    }
+
+    ret = assoofs_zero_range(inode, size, (first << inode->i_blkbits) - size);
+    if (ret)
+        return ret;
+    truncate_setsize(inode, size);
+    if (first >= U32_MAX)
+        return 0;
+
+    handle = assoofs_journal_start(sb, ASSOOFS_ALLOC_CREDITS);
+    if (IS_ERR(handle))
+        return PTR_ERR(handle);
+    assoofs_down_write(sb, &ai->i_data_sem);
+    ret = assoofs_remove_extents(inode, first, U32_MAX - first, &freed, &nfreed);
+    up_write(&ai->i_data_sem);
+    if (!ret) {
+        mark_inode_dirty(inode); // Antes de liberar: si el handle se reinicia, las extensiones ya no los tienen
+        ret = assoofs_release_blocks(inode, freed, nfreed, false);
+        kfree(freed);
+    }
+    err = assoofs_journal_stop(handle);
+    return ret ? ret : err;
+}
+
+// Bloques que se reservan y se ponen a cero por handle: acota lo que se retiene la transaccion
+#define ASSOOFS_PREALLOC_BLOCKS 2048
+
+/*
+ * Reserva los bloques que faltan en [offset, offset + len). No hay extensiones
+ * "sin escribir", asi que un bloque reservado tiene que leerse ya como ceros:
+ * se borra en el disco (con WRITE_ZEROES si el dispositivo lo tiene) antes de
+ * colgarlo del inodo.
+ */
+static int assoofs_prealloc(struct inode *inode, loff_t offset, loff_t len) {
+    struct super_block *sb = inode->i_sb;
+    struct assoofs_inode *ai = ASSOOFS_I(inode);
+    struct assoofs_extent extent;
+    uint64_t first = offset >> inode->i_blkbits;
+    uint64_t last = (offset + len - 1) >> inode->i_blkbits;
+    uint64_t block;
+    uint32_t count;
+    bool allocated;
+    handle_t *handle;
+    int ret, err;
+
+    if (last >= U32_MAX)
+        return -EFBIG;
+
+    while (first <= last) {
+        handle = assoofs_journal_start(sb, ASSOOFS_ALLOC_CREDITS);
+        if (IS_ERR(handle))
+            return PTR_ERR(handle);
+        assoofs_down_write(sb, &ai->i_data_sem);
+        allocated = false;
+        ret = assoofs_get_extent(sb, &ai->info, first, &extent);
+        if (!ret) {
+            count = extent.file_block + extent.block_count - first;
+        } else if (ret == -ENOENT) {
+            count = min_t(uint64_t, last - first + 1, ASSOOFS_PREALLOC_BLOCKS);
+            ret = assoofs_hole_length(sb, &ai->info, first, &count);
+            if (!ret)
+                ret = assoofs_sb_get_freeblocks(sb, assoofs_block_goal(inode, first), &block, &count);
+            if (!ret) {
+                ret = sb_issue_zeroout(sb, block, count, GFP_NOFS);
+                if (!ret)
+                    ret = assoofs_add_extent(inode, first, block, count);
+                if (ret)
+                    assoofs_sb_free_blocks(sb, block, count); // Aun no los ha visto nadie: se devuelven ya
+                else
+                    allocated = true;
+            }
+        }
+        up_write(&ai->i_data_sem);
+        if (allocated)
+            mark_inode_dirty(inode);
+        err = assoofs_journal_stop(handle);
+        if (!ret)
+            ret = err;
+        if (ret)
+            return ret;
+        first += count;
+    }
+    return 0;
+}
+
+static long assoofs_fallocate(struct file *file, int mode, loff_t offset, loff_t len) {
+    struct inode *inode = file_inode(file);
+    loff_t end = offset + len;
+    long ret;
+
+    // vfs_fallocate ya exige FALLOC_FL_KEEP_SIZE junto a FALLOC_FL_PUNCH_HOLE
+    if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE))
+        return -EOPNOTSUPP;
+
+    inode_lock(inode);
+    inode_dio_wait(inode); // Ni reservas ni huecos bajo un O_DIRECT en vuelo
+    if (!(mode & FALLOC_FL_KEEP_SIZE) && end > i_size_read(inode)) {
+        ret = inode_newsize_ok(inode, end);
+        if (ret)
+            goto out;
+    }
+    ret = file_modified(file);
+    if (!ret)
+        ret = assoofs_leave_inline_data(inode);
+    if (ret)
+        goto out;
+
+    if (mode & FALLOC_FL_PUNCH_HOLE) {
+        ret = assoofs_punch_hole(inode, offset, len);
+        goto out;
+    }
+    ret = assoofs_prealloc(inode, offset, len);
+    if (!ret && !(mode & FALLOC_FL_KEEP_SIZE) && end > i_size_read(inode)) {
+        i_size_write(inode, end);
+        inode->i_ctime = current_time(inode);
+        mark_inode_dirty(inode);
+    }
+out:
+    inode_unlock(inode);
+    return ret;
+}
+
+const struct address_space_operations assoofs_aops = {
+    .readpage = assoofs_readpage,
+    .readahead = assoofs_readahead,
+    .writepage = assoofs_writepage,
+    .writepages = assoofs_writepages,
+    .write_begin = assoofs_write_begin,
+    .write_end = assoofs_write_end,
+    .bmap = assoofs_bmap,
+    .direct_IO = noop_direct_IO, // O_DIRECT va por iomap en assoofs_file_read_iter y assoofs_file_write_iter
+};
+
+/*
+ *  Directorios: indice por hash en el bloque logico 0 y entradas en bloques hoja
+ */
+
+static unsigned int assoofs_dir_index_max(struct super_block *sb) {
+    return (sb->s_blocksize - sizeof(struct assoofs_dir_index)) / sizeof(struct assoofs_dir_index_entry);
+}
+
+/*
+ * Lee el bloque logico file_block del directorio.
+ */
+static struct buffer_head *assoofs_dir_bread(struct super_block *sb, struct assoofs_inode_info *dir_info, uint32_t file_block) {
+    struct assoofs_extent extent;
+
+    if (assoofs_get_extent(sb, dir_info, file_block, &extent))
+        return NULL;
+    assoofs_stat_inc(sb, ASSOOFS_STAT_META_READS);
+    return sb_bread(sb, extent.start_block + (file_block - extent.file_block));
+}
+
+/*
+ * Posicion en el indice de la hoja que corresponde a hash: la ultima entrada
+ * con un hash menor o igual.
+ */
+static unsigned int assoofs_dir_index_find(struct assoofs_dir_index *index, uint32_t hash) {
+    unsigned int lo = 1, hi = index->count, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (index->entries[mid].hash <= hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo - 1;
+}
+
+static inline unsigned int assoofs_rec_len(struct assoofs_dir_record_entry *record) {
+    return assoofs_rec_len_from_disk(record->rec_len);
+}
+
+static inline void assoofs_set_rec_len(struct assoofs_dir_record_entry *record, unsigned int len) {
+    record->rec_len = assoofs_rec_len_to_disk(len);
+}
+
+/*
+ * Devuelve la entrada de la hoja que empieza en offset, o NULL si es el final
+ * del bloque o la cadena de rec_len esta corrupta.
+ */
+static struct assoofs_dir_record_entry *assoofs_dir_record(struct super_block *sb, char *leaf, unsigned int offset) {
+    struct assoofs_dir_record_entry *record = (struct assoofs_dir_record_entry *)(leaf + offset);
+
+    if (offset + ASSOOFS_DIR_REC_HEADER > sb->s_blocksize)
+        return NULL;
+    if (assoofs_rec_len(record) < ASSOOFS_DIR_REC_LEN(record->name_len) || offset + assoofs_rec_len(record) > sb->s_blocksize) {
+        printk(KERN_ERR "Corrupted directory entry at offset %u", offset);
+        return NULL;
+    }
+    return record;
+}
+
+#define assoofs_for_each_record(sb, leaf, record, offset) \
+    for (offset = 0; (record = assoofs_dir_record(sb, leaf, offset)) != NULL; offset += assoofs_rec_len(record))
+
+/*
+ * Deja la hoja vacia: una unica entrada libre que ocupa todo el bloque.
+ */
+static void assoofs_dir_leaf_init(struct super_block *sb, char *leaf) {
+    struct assoofs_dir_record_entry *record = (struct assoofs_dir_record_entry *)leaf;
+
+    memset(leaf, 0, sb->s_blocksize);
+    assoofs_set_rec_len(record, sb->s_blocksize);
+}
+
+/*
+ * Copia record al final de una hoja que se esta rellenando de forma compacta.
+ * *offset es el final de lo escrito y *last la ultima entrada copiada, cuyo
+ * rec_len se estira hasta el final del bloque.
+ */
+static void assoofs_dir_leaf_append(struct super_block *sb, char *leaf, unsigned int *offset, struct assoofs_dir_record_entry **last, struct assoofs_dir_record_entry *record) {
+    struct assoofs_dir_record_entry *copy = (struct assoofs_dir_record_entry *)(leaf + *offset);
+    unsigned int len = ASSOOFS_DIR_REC_LEN(record->name_len);
+
+    if (*last)
+        assoofs_set_rec_len(*last, (char *)copy - (char *)*last);
+    memcpy(copy, record, ASSOOFS_DIR_REC_HEADER + record->name_len);
+    assoofs_set_rec_len(copy, sb->s_blocksize - *offset);
+    *offset += len;
+    *last = copy;
+}
+
+/*
+ * Busca en la hoja un hueco para una entrada de len bytes. Si el hueco esta al
+ * final de una entrada ocupada, la parte y devuelve la nueva.
+ */
+static struct assoofs_dir_record_entry *assoofs_dir_leaf_find_space(struct super_block *sb, char *leaf, unsigned int len) {
+    struct assoofs_dir_record_entry *record, *free_record;
+    unsigned int offset, used;
+
+    assoofs_for_each_record(sb, leaf, record, offset) {
+        used = record->inode_no ? ASSOOFS_DIR_REC_LEN(record->name_len) : 0;
+        if (assoofs_rec_len(record) - used < len)
+            continue;
+        if (!used)
+            return record;
+
+        free_record = (struct assoofs_dir_record_entry *)((char *)record + used);
+        assoofs_set_rec_len(free_record, assoofs_rec_len(record) - used);
+        free_record->inode_no = 0;
+        assoofs_set_rec_len(record, used);
+        return free_record;
+    }
+    return NULL;
+}
+
+/*
+ * Crea el indice y la primera hoja (vacia) de un directorio nuevo.
+ */
+static int assoofs_dir_init(struct inode *dir) {
+    struct super_block *sb = dir->i_sb;
+    struct assoofs_inode_info *dir_info = &ASSOOFS_I(dir)->info;
+    struct buffer_head *bh;
+    struct assoofs_dir_index *index;
+    int ret;
+
+    ret = assoofs_alloc_file_blocks(dir, 2);
+    if (ret)
+        return ret;
+
+    bh = assoofs_dir_bread(sb, dir_info, 0);
+    if (!bh)
+        return -EIO;
+    ret = assoofs_journal_get_write_access(sb, bh);
+    if (!ret) {
+        memset(bh->b_data, 0, sb->s_blocksize);
+        index = (struct assoofs_dir_index *)bh->b_data;
+        index->count = 1;
+        index->entries[0].hash = 0;
+        index->entries[0].block = 1;
+        ret = assoofs_journal_dirty_metadata(sb, dir, bh);
+    }
+    brelse(bh);
+    if (ret)
+        return ret;
+
+    bh = assoofs_dir_bread(sb, dir_info, 1);
+    if (!bh)
+        return -EIO;
+    ret = assoofs_journal_get_write_access(sb, bh);
+    if (!ret) {
+        assoofs_dir_leaf_init(sb, bh->b_data);
+        ret = assoofs_journal_dirty_metadata(sb, dir, bh);
+    }
+    brelse(bh);
+    return ret;
+}
+
+/*
+ * Busca name en el directorio leyendo solo el indice y una hoja. Devuelve el
+ * numero de inodo o 0 si no existe.
+ */
+static uint64_t assoofs_dir_find_entry(struct super_block *sb, struct assoofs_inode_info *dir_info, const char *name, unsigned int len) {
+    struct buffer_head *bh;
+    struct assoofs_dir_index *index;
+    struct assoofs_dir_record_entry *record;
+    uint32_t leaf;
+    uint64_t inode_no = 0;
+    unsigned int offset;
+
+    bh = assoofs_dir_bread(sb, dir_info, 0);
+    if (!bh)
+        return 0;
+    index = (struct assoofs_dir_index *)bh->b_data;
+    leaf = index->entries[assoofs_dir_index_find(index, assoofs_name_hash(name, len))].block;
+    brelse(bh);
 
+    bh = assoofs_dir_bread(sb, dir_info, leaf);
+    if (!bh)
+        return 0;
+    assoofs_for_each_record(sb, bh->b_data, record, offset) {
+        if (record->inode_no && record->name_len == len && !memcmp(record->filename, name, len)) {
+            inode_no = record->inode_no;
+            break;
+        }
+    }
+    brelse(bh);
+    return inode_no;
+}
 
 /*
- *  Operaciones sobre ficheros
+ *  Cache de nombres por directorio: una tabla hash en memoria con todas las
+ *  entradas del directorio, construida en el primer lookup y mantenida al dia
+ *  por create, mkdir, unlink y rmdir. Como tiene todos los nombres, no encontrar uno en ella
+ *  es un "no existe" definitivo y lookup no lee ningun bloque. Los directorios
+ *  con cache estan en s_dcache_lru, que recorre el shrinker cuando falta
+ *  memoria; el siguiente lookup la vuelve a construir.
+ *
+ *  lookup recorre la tabla bajo RCU. Se construye y se modifica con el i_rwsem
+ *  del directorio tomado (compartido en lookup, exclusivo al modificarlo),
+ *  asi que una construccion nunca ve el directorio a medio cambiar;
+ *  i_dcache_lock solo ordena la publicacion de i_dcache frente al shrinker y
+ *  a evict, que la desenganchan.
  */
 
-int assoofs_save_inode_info(struct super_block *sb, struct assoofs_inode_info *inode_info);
+#define ASSOOFS_DCACHE_MIN_BITS 4
 
-ssize_t assoofs_read(struct file * filp, char __user * buf, size_t len, loff_t * ppos);
-ssize_t assoofs_write(struct file * filp, const char __user * buf, size_t len, loff_t * ppos);
-const struct file_operations assoofs_file_operations = {
-    .read = assoofs_read,
-    .write = assoofs_write,
+struct assoofs_dcache_entry {
+    struct hlist_node node;
+    struct rcu_head rcu;
+    uint64_t inode_no;
+    uint32_t hash;
+    uint8_t name_len;
+    char name[];
 };
 
-ssize_t assoofs_read(struct file * filp, char __user * buf, size_t len, loff_t * ppos) {
-    struct assoofs_inode_info *inode_info;
+struct assoofs_dcache {
+    struct list_head lru;           // En s_dcache_lru
+    struct assoofs_inode *ai;       // Directorio al que pertenece
+    struct rcu_head rcu;
+    unsigned int count;
+    unsigned int bits;              // La tabla tiene 1 << bits listas
+    bool referenced;                // Usada desde la ultima pasada del shrinker
+    struct hlist_head *buckets;     // Aparte: puede venir de vmalloc, y list_lru necesita la pagina de lru
+};
+
+static struct assoofs_dcache *assoofs_dcache_alloc(struct assoofs_inode *ai, uint64_t entries) {
+    struct assoofs_dcache *cache;
+    unsigned int bits = ASSOOFS_DCACHE_MIN_BITS;
+
+    while (bits < 24 && (1ULL << bits) < entries)
+        bits++;
+    cache = kzalloc(sizeof(*cache), GFP_KERNEL);
+    if (!cache)
+        return NULL;
+    cache->buckets = kvcalloc(1U << bits, sizeof(*cache->buckets), GFP_KERNEL);
+    if (!cache->buckets) {
+        kfree(cache);
+        return NULL;
+    }
+    INIT_LIST_HEAD(&cache->lru);
+    cache->ai = ai;
+    cache->bits = bits;
+    return cache;
+}
+
+static void assoofs_dcache_free_now(struct assoofs_dcache *cache) {
+    struct assoofs_dcache_entry *entry;
+    struct hlist_node *tmp;
+    unsigned int i;
+
+    for (i = 0; i < (1U << cache->bits); i++)
+        hlist_for_each_entry_safe(entry, tmp, &cache->buckets[i], node)
+            kfree(entry);
+    kvfree(cache->buckets);
+    kfree(cache);
+}
+
+static void assoofs_dcache_free_rcu(struct rcu_head *head) {
+    assoofs_dcache_free_now(container_of(head, struct assoofs_dcache, rcu));
+}
+
+// Una cache ya publicada puede tener lectores: se libera tras un periodo de gracia
+static void assoofs_dcache_free(struct assoofs_dcache *cache) {
+    call_rcu(&cache->rcu, assoofs_dcache_free_rcu);
+}
+
+static struct assoofs_dcache_entry *assoofs_dcache_entry_alloc(const char *name, unsigned int len, uint64_t inode_no) {
+    struct assoofs_dcache_entry *entry;
+
+    entry = kmalloc(struct_size(entry, name, len), GFP_KERNEL);
+    if (!entry)
+        return NULL;
+    entry->inode_no = inode_no;
+    entry->hash = assoofs_name_hash(name, len);
+    entry->name_len = len;
+    memcpy(entry->name, name, len);
+    return entry;
+}
+
+static void assoofs_dcache_insert(struct assoofs_dcache *cache, struct assoofs_dcache_entry *entry) {
+    hlist_add_head_rcu(&entry->node, &cache->buckets[hash_32(entry->hash, cache->bits)]);
+    cache->count++;
+}
+
+/*
+ * Quita la cache del directorio, si la tiene. Se usa al expulsar el inodo y
+ * cuando la cache deja de ser valida o se queda pequena.
+ */
+static void assoofs_dcache_drop(struct inode *dir) {
+    struct assoofs_inode *ai = ASSOOFS_I(dir);
+    struct assoofs_dcache *cache;
+
+    spin_lock(&ai->i_dcache_lock);
+    cache = rcu_dereference_protected(ai->i_dcache, lockdep_is_held(&ai->i_dcache_lock));
+    RCU_INIT_POINTER(ai->i_dcache, NULL);
+    spin_unlock(&ai->i_dcache_lock);
+    if (!cache)
+        return;
+    list_lru_del(&ASSOOFS_SB(dir->i_sb)->s_dcache_lru, &cache->lru);
+    assoofs_dcache_free(cache);
+}
+
+/*
+ * Lee todas las hojas del directorio y publica su cache. Si otro lookup
+ * paralelo la ha publicado antes, se descarta la propia.
+ */
+static int assoofs_dcache_build(struct inode *dir) {
+    struct super_block *sb = dir->i_sb;
+    struct assoofs_inode *ai = ASSOOFS_I(dir);
+    struct assoofs_dcache *cache;
+    struct assoofs_dcache_entry *entry;
+    struct assoofs_dir_record_entry *record;
     struct buffer_head *bh;
-    char *buffer;
-    int nbytes;
+    uint32_t blocks, lblk;
+    unsigned int offset;
+    int ret;
+
+    down_read(&ai->i_data_sem);
+    ret = assoofs_file_blocks(sb, &ai->info, &blocks);
+    up_read(&ai->i_data_sem);
+    if (ret)
+        return ret;
+
+    cache = assoofs_dcache_alloc(ai, ai->info.dir_children_count);
+    if (!cache)
+        return -ENOMEM;
+
+    for (lblk = 1; lblk < blocks; lblk++) {
+        bh = assoofs_dir_bread(sb, &ai->info, lblk);
+        if (!bh) {
+            ret = -EIO;
+            goto out_free;
+        }
+        assoofs_for_each_record(sb, bh->b_data, record, offset) {
+            if (!record->inode_no)
+                continue;
+            entry = assoofs_dcache_entry_alloc(record->filename, record->name_len, record->inode_no);
+            if (!entry) {
+                brelse(bh);
+                ret = -ENOMEM;
+                goto out_free;
+            }
+            assoofs_dcache_insert(cache, entry);
+        }
+        brelse(bh);
+    }
 
-    printk(KERN_INFO "Read request\n");
+    spin_lock(&ai->i_dcache_lock);
+    if (rcu_access_pointer(ai->i_dcache)) {
+        spin_unlock(&ai->i_dcache_lock);
+        goto out_free;
+    }
+    rcu_assign_pointer(ai->i_dcache, cache);
+    spin_unlock(&ai->i_dcache_lock);
+    list_lru_add(&ASSOOFS_SB(sb)->s_dcache_lru, &cache->lru);
+    assoofs_stat_inc(sb, ASSOOFS_STAT_DCACHE_BUILDS);
+    return 0;
 
-    inode_info = filp->f_path.dentry->d_inode->i_private;
+out_free:
+    assoofs_dcache_free_now(cache);
+    return ret;
+}
 
-    if (*ppos >= inode_info->file_size) return 0;
-   
-    bh = sb_bread(filp->f_path.dentry->d_inode->i_sb, inode_info->data_block_number);
+/*
+ * Busca name en la cache del directorio. Devuelve true, con el numero de inodo
+ * (0 si el nombre no existe) en *inode_no, si el directorio tiene cache.
+ */
+static bool assoofs_dcache_lookup(struct inode *dir, const char *name, unsigned int len, uint64_t *inode_no) {
+    struct assoofs_dcache *cache;
+    struct assoofs_dcache_entry *entry;
+    uint32_t hash = assoofs_name_hash(name, len);
+
+    rcu_read_lock();
+    cache = rcu_dereference(ASSOOFS_I(dir)->i_dcache);
+    if (!cache) {
+        rcu_read_unlock();
+        return false;
+    }
+    *inode_no = 0;
+    hlist_for_each_entry_rcu(entry, &cache->buckets[hash_32(hash, cache->bits)], node) {
+        if (entry->hash == hash && entry->name_len == len && !memcmp(entry->name, name, len)) {
+            *inode_no = entry->inode_no;
+            break;
+        }
+    }
+    if (!READ_ONCE(cache->referenced))
+        WRITE_ONCE(cache->referenced, true);
+    rcu_read_unlock();
+    return true;
+}
 
-    buffer = (char *)bh->b_data;
-    
-    nbytes = min((size_t) inode_info->file_size, len); // Hay que comparar len con el tama~no del fichero por si llegamos al    final del fichero
-    copy_to_user(buf, buffer, nbytes);
-    brelse(bh);
+/*
+ * Anade a la cache del directorio, si la tiene, la entrada que create o mkdir
+ * acaban de escribir. Si no hay memoria, o la tabla tiene ya el doble de
+ * entradas que listas, se tira la cache y el siguiente lookup la reconstruye
+ * con el tamano adecuado.
+ */
+static void assoofs_dcache_add(struct inode *dir, const char *name, unsigned int len, uint64_t inode_no) {
+    struct assoofs_inode *ai = ASSOOFS_I(dir);
+    struct assoofs_dcache *cache;
+    struct assoofs_dcache_entry *entry;
+
+    if (!rcu_access_pointer(ai->i_dcache))
+        return;
+    entry = assoofs_dcache_entry_alloc(name, len, inode_no);
+
+    spin_lock(&ai->i_dcache_lock);
+    cache = rcu_dereference_protected(ai->i_dcache, lockdep_is_held(&ai->i_dcache_lock));
+    if (cache && entry && cache->count < (2U << cache->bits)) {
+        assoofs_dcache_insert(cache, entry);
+        spin_unlock(&ai->i_dcache_lock);
+        return;
+    }
+    spin_unlock(&ai->i_dcache_lock);
+    kfree(entry);
+    assoofs_dcache_drop(dir);
+}
+
+// Quita de la cache del directorio, si la tiene, la entrada que unlink o rmdir acaban de borrar
+static void assoofs_dcache_remove(struct inode *dir, const char *name, unsigned int len) {
+    struct assoofs_inode *ai = ASSOOFS_I(dir);
+    struct assoofs_dcache *cache;
+    struct assoofs_dcache_entry *entry;
+    uint32_t hash = assoofs_name_hash(name, len);
+
+    spin_lock(&ai->i_dcache_lock);
+    cache = rcu_dereference_protected(ai->i_dcache, lockdep_is_held(&ai->i_dcache_lock));
+    if (cache) {
+        hlist_for_each_entry(entry, &cache->buckets[hash_32(hash, cache->bits)], node) {
+            if (entry->hash == hash && entry->name_len == len && !memcmp(entry->name, name, len)) {
+                hlist_del_rcu(&entry->node);
+                cache->count--;
+                kfree_rcu(entry, rcu);
+                break;
+            }
+        }
+    }
+    spin_unlock(&ai->i_dcache_lock);
+}
+
+static enum lru_status assoofs_dcache_isolate(struct list_head *item, struct list_lru_one *lru, spinlock_t *lru_lock, void *arg) {
+    struct assoofs_dcache *cache = container_of(item, struct assoofs_dcache, lru);
+    struct assoofs_inode *ai = cache->ai;
+    struct list_head *dispose = arg;
+
+    // Segunda oportunidad para las caches usadas desde la ultima pasada
+    if (READ_ONCE(cache->referenced)) {
+        WRITE_ONCE(cache->referenced, false);
+        return LRU_ROTATE;
+    }
+    if (!spin_trylock(&ai->i_dcache_lock))
+        return LRU_SKIP;
+    // Si ya no es la cache del directorio, assoofs_dcache_drop la esta quitando de la lista
+    if (rcu_access_pointer(ai->i_dcache) != cache) {
+        spin_unlock(&ai->i_dcache_lock);
+        return LRU_SKIP;
+    }
+    RCU_INIT_POINTER(ai->i_dcache, NULL);
+    spin_unlock(&ai->i_dcache_lock);
+    list_lru_isolate_move(lru, item, dispose);
+    return LRU_REMOVED;
+}
 
-    *ppos += nbytes;
-    return nbytes;
+static unsigned long assoofs_dcache_count(struct shrinker *shrink, struct shrink_control *sc) {
+    struct assoofs_sb_info *sbi = container_of(shrink, struct assoofs_sb_info, s_dcache_shrinker);
 
+    return list_lru_shrink_count(&sbi->s_dcache_lru, sc);
 }
 
-ssize_t assoofs_write(struct file * filp, const char __user * buf, size_t len, loff_t * ppos) {
-    struct assoofs_inode_info *inode_info;
+static unsigned long assoofs_dcache_scan(struct shrinker *shrink, struct shrink_control *sc) {
+    struct assoofs_sb_info *sbi = container_of(shrink, struct assoofs_sb_info, s_dcache_shrinker);
+    struct assoofs_dcache *cache, *next;
+    unsigned long freed;
+    LIST_HEAD(dispose);
+
+    freed = list_lru_shrink_walk(&sbi->s_dcache_lru, sc, assoofs_dcache_isolate, &dispose);
+    list_for_each_entry_safe(cache, next, &dispose, lru)
+        assoofs_dcache_free(cache);
+    return freed;
+}
+
+static int assoofs_cmp_hash(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * Parte la hoja llena leaf_bh (posicion pos del indice) moviendo a una hoja
+ * nueva las entradas con hash mayor o igual que la mediana, que se devuelve en
+ * *split_hash. Las entradas que se quedan no cambian de desplazamiento, porque
+ * readdir lo guarda en f_pos; el hueco de las que se van se suma a la entrada
+ * anterior. La hoja nueva se rellena compacta y se devuelve en *new_bh.
+ */
+static int assoofs_dir_split_leaf(struct inode *dir, struct buffer_head *index_bh, unsigned int pos, struct buffer_head *leaf_bh, struct buffer_head **new_bh, uint32_t *split_hash) {
+    struct super_block *sb = dir->i_sb;
+    struct assoofs_inode_info *dir_info = &ASSOOFS_I(dir)->info;
+    struct assoofs_dir_index *index = (struct assoofs_dir_index *)index_bh->b_data;
+    struct assoofs_dir_record_entry *record, *prev = NULL, *last_new = NULL;
+    unsigned int n = 0, i, j, offset, new_offset = 0;
+    uint32_t *hashes, new_block, hash;
     struct buffer_head *bh;
-    char *buffer;
-    struct super_block *sb;
+    char *copy;
+    int ret = -ENOSPC;
+
+    if (index->count >= assoofs_dir_index_max(sb))
+        return -ENOSPC;
+    ret = assoofs_journal_get_write_access(sb, index_bh);
+    if (ret)
+        return ret;
+    ret = -ENOSPC;
+
+    copy = kmalloc(sb->s_blocksize, GFP_KERNEL);
+    hashes = kmalloc_array(sb->s_blocksize / ASSOOFS_DIR_REC_LEN(1), sizeof(*hashes), GFP_KERNEL);
+    if (!copy || !hashes) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    memcpy(copy, leaf_bh->b_data, sb->s_blocksize);
+
+    assoofs_for_each_record(sb, copy, record, offset)
+        if (record->inode_no)
+            hashes[n++] = assoofs_name_hash(record->filename, record->name_len);
+    sort(hashes, n, sizeof(*hashes), assoofs_cmp_hash, NULL);
+
+    // Las entradas con el mismo hash tienen que quedar en la misma hoja
+    for (j = n / 2; j > 0 && j < n && hashes[j] == hashes[j - 1]; j++)
+        ;
+    if (j == n)
+        for (j = n / 2 - 1; j > 0 && hashes[j] == hashes[j - 1]; j--)
+            ;
+    if (j == 0 || j == n) {
+        printk(KERN_ERR "Too many hash collisions in directory %llu", dir_info->inode_no);
+        goto out;
+    }
+    *split_hash = hashes[j];
+
+    ret = assoofs_file_blocks(sb, dir_info, &new_block);
+    if (!ret)
+        ret = assoofs_alloc_file_blocks(dir, new_block + 1);
+    if (ret)
+        goto out;
+    bh = assoofs_dir_bread(sb, dir_info, new_block);
+    if (!bh) {
+        ret = -EIO;
+        goto out;
+    }
+    ret = assoofs_journal_get_write_access(sb, bh);
+    if (ret) {
+        brelse(bh);
+        goto out;
+    }
 
-    printk(KERN_INFO "Write request\n");
+    assoofs_dir_leaf_init(sb, bh->b_data);
+    assoofs_for_each_record(sb, copy, record, offset) {
+        if (!record->inode_no)
+            continue;
+        hash = assoofs_name_hash(record->filename, record->name_len);
+        if (hash >= *split_hash)
+            assoofs_dir_leaf_append(sb, bh->b_data, &new_offset, &last_new, record);
+    }
+    ret = assoofs_journal_dirty_metadata(sb, dir, bh);
+    if (ret) {
+        brelse(bh);
+        goto out;
+    }
+
+    assoofs_for_each_record(sb, leaf_bh->b_data, record, offset) {
+        if (!record->inode_no || assoofs_name_hash(record->filename, record->name_len) < *split_hash) {
+            prev = record;
+            continue;
+        }
+        if (prev)
+            assoofs_set_rec_len(prev, assoofs_rec_len(prev) + assoofs_rec_len(record));
+        else
+            record->inode_no = 0;
+    }
 
-    inode_info = filp->f_path.dentry->d_inode->i_private;
-    sb = filp->f_path.dentry->d_inode->i_sb;
+    i = pos + 1;
+    memmove(&index->entries[i + 1], &index->entries[i], (index->count - i) * sizeof(index->entries[0]));
+    index->entries[i].hash = *split_hash;
+    index->entries[i].block = new_block;
+    index->count++;
+    ret = assoofs_journal_dirty_metadata(sb, dir, index_bh);
+    if (ret) {
+        brelse(bh);
+        goto out;
+    }
 
+    *new_bh = bh;
+out:
+    kfree(hashes);
+    kfree(copy);
+    return ret;
+}
 
-    bh = sb_bread(filp->f_path.dentry->d_inode->i_sb, inode_info->data_block_number);
-    buffer = (char *)bh->b_data;
-    
-    buffer += *ppos;
-    copy_from_user(buffer, buf, len);
-    *ppos += len;
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
+/*
+ * Anade la entrada name -> inode_no al directorio dir a traves del indice,
+ * partiendo la hoja si no queda hueco. La VFS llama a create y mkdir con el
+ * i_rwsem de dir tomado en exclusiva, asi que cada directorio se modifica de
+ * uno en uno sin serializar altas en directorios distintos.
+ */
+static int assoofs_dir_add_entry(struct inode *dir, const char *name, unsigned int len, uint64_t inode_no, umode_t mode) {
+    struct super_block *sb = dir->i_sb;
+    struct assoofs_inode_info *dir_info = &ASSOOFS_I(dir)->info;
+    struct buffer_head *index_bh, *leaf_bh, *new_bh;
+    struct assoofs_dir_index *index;
+    struct assoofs_dir_record_entry *record;
+    uint32_t hash = assoofs_name_hash(name, len), split_hash;
+    unsigned int pos;
+    int ret;
+
+    index_bh = assoofs_dir_bread(sb, dir_info, 0);
+    if (!index_bh)
+        return -EIO;
+    index = (struct assoofs_dir_index *)index_bh->b_data;
+    pos = assoofs_dir_index_find(index, hash);
+
+    leaf_bh = assoofs_dir_bread(sb, dir_info, index->entries[pos].block);
+    if (!leaf_bh) {
+        brelse(index_bh);
+        return -EIO;
+    }
+    ret = assoofs_journal_get_write_access(sb, leaf_bh);
+    if (ret) {
+        brelse(leaf_bh);
+        brelse(index_bh);
+        return ret;
+    }
+
+    record = assoofs_dir_leaf_find_space(sb, leaf_bh->b_data, ASSOOFS_DIR_REC_LEN(len));
+    if (!record) {
+        ret = assoofs_dir_split_leaf(dir, index_bh, pos, leaf_bh, &new_bh, &split_hash);
+        if (!ret) {
+            ret = assoofs_journal_dirty_metadata(sb, dir, leaf_bh);
+            if (ret)
+                brelse(new_bh);
+        }
+        if (ret) {
+            brelse(leaf_bh);
+            brelse(index_bh);
+            return ret;
+        }
+        if (hash >= split_hash) {
+            brelse(leaf_bh);
+            leaf_bh = new_bh;
+        } else {
+            brelse(new_bh);
+        }
+        record = assoofs_dir_leaf_find_space(sb, leaf_bh->b_data, ASSOOFS_DIR_REC_LEN(len));
+    }
+    brelse(index_bh);
+    if (!record) {
+        brelse(leaf_bh);
+        return -ENOSPC;
+    }
+
+    record->inode_no = inode_no;
+    record->name_len = len;
+    record->file_type = fs_umode_to_ftype(mode);
+    memcpy(record->filename, name, len);
+    ret = assoofs_journal_dirty_metadata(sb, dir, leaf_bh);
+    brelse(leaf_bh);
+    if (ret)
+        return ret;
+    assoofs_dcache_add(dir, name, len, inode_no);
+
+    assoofs_down_write(dir->i_sb, &ASSOOFS_I(dir)->i_data_sem);
+    dir_info->dir_children_count++;
+    up_write(&ASSOOFS_I(dir)->i_data_sem);
+
+    dir->i_mtime = dir->i_ctime = current_time(dir);
+    inode_inc_iversion(dir); // Los readdir abiertos revalidan su posicion
+    mark_inode_dirty(dir);
+
+    // Con DIRSYNC (mount -o dirsync, chattr +D) el cambio tiene que llegar al disco antes de volver
+    if (IS_DIRSYNC(dir) && ASSOOFS_SB(sb)->s_journal) {
+        journal_current_handle()->h_sync = 1; // jbd2_journal_stop confirma la transaccion y espera
+        return 0;
+    }
+    if (IS_DIRSYNC(dir)) {
+        ret = sync_mapping_buffers(dir->i_mapping);
+        if (!ret)
+            ret = sync_inode_metadata(dir, 1);
+        return ret;
+    }
+    return 0;
+}
+
+/*
+ * Borra la entrada name, que tiene que llevar a inode_no, del directorio. Su
+ * hueco se une a la entrada anterior de la hoja o, si es la primera, queda
+ * como entrada libre.
+ */
+static int assoofs_dir_remove_entry(struct inode *dir, const char *name, unsigned int len, uint64_t inode_no) {
+    struct super_block *sb = dir->i_sb;
+    struct assoofs_inode_info *dir_info = &ASSOOFS_I(dir)->info;
+    struct buffer_head *bh;
+    struct assoofs_dir_index *index;
+    struct assoofs_dir_record_entry *record, *prev = NULL;
+    unsigned int offset;
+    uint32_t leaf;
+    int ret;
+
+    bh = assoofs_dir_bread(sb, dir_info, 0);
+    if (!bh)
+        return -EIO;
+    index = (struct assoofs_dir_index *)bh->b_data;
+    leaf = index->entries[assoofs_dir_index_find(index, assoofs_name_hash(name, len))].block;
     brelse(bh);
 
-    mutex_lock_interruptible(&assoofs_inodes_mgmt_lock);
+    bh = assoofs_dir_bread(sb, dir_info, leaf);
+    if (!bh)
+        return -EIO;
+    ret = assoofs_journal_get_write_access(sb, bh);
+    if (ret) {
+        brelse(bh);
+        return ret;
+    }
+    ret = -ENOENT;
+    assoofs_for_each_record(sb, bh->b_data, record, offset) {
+        if (record->inode_no == inode_no && record->name_len == len && !memcmp(record->filename, name, len)) {
+            ret = 0;
+            break;
+        }
+        prev = record;
+    }
+    if (ret) {
+        printk(KERN_ERR "Directory %lu has no entry for inode %llu", dir->i_ino, inode_no);
+        brelse(bh);
+        return -EIO;
+    }
+    if (prev)
+        assoofs_set_rec_len(prev, assoofs_rec_len(prev) + assoofs_rec_len(record));
+    else
+        record->inode_no = 0;
+    ret = assoofs_journal_dirty_metadata(sb, dir, bh);
+    brelse(bh);
+    if (ret)
+        return ret;
+    assoofs_dcache_remove(dir, name, len);
 
-    inode_info->file_size = *ppos;
-    assoofs_save_inode_info(sb, inode_info);
+    assoofs_down_write(dir->i_sb, &ASSOOFS_I(dir)->i_data_sem);
+    dir_info->dir_children_count--;
+    up_write(&ASSOOFS_I(dir)->i_data_sem);
 
-   
-    mutex_unlock(&assoofs_inodes_mgmt_lock);
-    return len;
+    dir->i_mtime = dir->i_ctime = current_time(dir);
+    inode_inc_iversion(dir); // Los readdir abiertos revalidan su posicion
+    mark_inode_dirty(dir);
 
+    if (IS_DIRSYNC(dir) && ASSOOFS_SB(sb)->s_journal) {
+        journal_current_handle()->h_sync = 1;
+        return 0;
+    }
+    if (IS_DIRSYNC(dir)) {
+        ret = sync_mapping_buffers(dir->i_mapping);
+        if (!ret)
+            ret = sync_inode_metadata(dir, 1);
+        return ret;
+    }
+    return 0;
 }
 
 /*
@@ -93,53 +2509,94 @@ ssize_t assoofs_write(struct file * filp, const char __user * buf, size_t len, l
 static int assoofs_iterate(struct file *filp, struct dir_context *ctx);
 const struct file_operations assoofs_dir_operations = {
     .owner = THIS_MODULE,
-    .iterate = assoofs_iterate,
+    .llseek = generic_file_llseek,
+    .read = generic_read_dir,
+    .iterate_shared = assoofs_iterate,
+    .fsync = assoofs_fsync,
 };
 
+/*
+ * Si el directorio ha cambiado desde la ultima llamada, offset puede haber
+ * quedado dentro de una entrada (p.ej. la que se sumo a la anterior al partir
+ * la hoja). Se recorre la hoja desde el principio hasta el primer inicio de
+ * entrada que no quede antes de offset.
+ */
+static unsigned int assoofs_dir_validate_offset(struct super_block *sb, char *leaf, unsigned int offset) {
+    struct assoofs_dir_record_entry *record;
+    unsigned int i;
+
+    assoofs_for_each_record(sb, leaf, record, i)
+        if (i >= offset)
+            break;
+    return record ? i : sb->s_blocksize;
+}
+
+/*
+ * ctx->pos es (bloque logico << s_blocksize_bits) | desplazamiento en la hoja,
+ * asi que cada getdents continua justo donde paro el anterior. Las posiciones
+ * 0 y 1 son "." y ".."; el bloque 0 es el indice y no tiene entradas. Las hojas
+ * se recorren por orden de bloque, de una en una.
+ */
 static int assoofs_iterate(struct file *filp, struct dir_context *ctx) {
-    struct inode *inode;
-    struct super_block *sb;
-    struct assoofs_inode_info *inode_info = NULL;
-    struct buffer_head *bh;
+    struct inode *inode = file_inode(filp);
+    struct super_block *sb = inode->i_sb;
+    struct assoofs_inode_info *inode_info = &ASSOOFS_I(inode)->info;
     struct assoofs_dir_record_entry *record;
-    int i;
+    struct buffer_head *bh;
+    bool need_revalidate = !inode_eq_iversion(inode, filp->f_version);
+    uint32_t blocks, lblk;
+    unsigned int offset;
+    int ret;
 
-    
-    if (ctx->pos) 
+    trace_assoofs_iterate(inode, ctx->pos);
+    if (!dir_emit_dots(filp, ctx))
         return 0;
-    printk(KERN_INFO "Iterate request\n");
-    inode = filp->f_path.dentry->d_inode;
-    sb = inode->i_sb;
-    inode_info = inode->i_private;
-
-    record = (struct assoofs_dir_record_entry *)bh->b_data;
 
+    down_read(&ASSOOFS_I(inode)->i_data_sem);
+    ret = assoofs_file_blocks(sb, inode_info, &blocks);
+    up_read(&ASSOOFS_I(inode)->i_data_sem);
+    if (ret)
+        return ret;
+
+    lblk = ctx->pos >> sb->s_blocksize_bits;
+    offset = ctx->pos & (sb->s_blocksize - 1);
+    if (lblk == 0) {
+        lblk = 1;
+        offset = 0;
+    }
 
-    if ((!S_ISDIR(inode_info->mode))) 
-        return -1;
-    
-    bh = sb_bread(sb, inode_info->data_block_number);
-    record = (struct assoofs_dir_record_entry *)bh->b_data;
-    for (i = 0; i < inode_info->dir_children_count; i++) {
-        dir_emit(ctx, record->filename, ASSOOFS_FILENAME_MAXLEN, record->inode_no, DT_UNKNOWN);
-        ctx->pos += sizeof(struct assoofs_dir_record_entry);
-        record++;
+    for (; lblk < blocks; lblk++, offset = 0) {
+        bh = assoofs_dir_bread(sb, inode_info, lblk);
+        if (!bh) {
+            printk(KERN_ERR "Unable to read directory %lu block %u", inode->i_ino, lblk);
+            return -EIO;
+        }
+        if (need_revalidate) {
+            offset = assoofs_dir_validate_offset(sb, bh->b_data, offset);
+            ctx->pos = ((loff_t)lblk << sb->s_blocksize_bits) | offset;
+            filp->f_version = inode_query_iversion(inode);
+            need_revalidate = false;
+        }
+        for (; (record = assoofs_dir_record(sb, bh->b_data, offset)) != NULL; offset += assoofs_rec_len(record)) {
+            if (record->inode_no && !dir_emit(ctx, record->filename, record->name_len, record->inode_no, fs_ftype_to_dtype(record->file_type))) {
+                brelse(bh);
+                return 0; // Buffer de usuario lleno: se sigue desde ctx->pos
+            }
+            ctx->pos = ((loff_t)lblk << sb->s_blocksize_bits) + offset + assoofs_rec_len(record);
+        }
+        brelse(bh);
+        ctx->pos = (loff_t)(lblk + 1) << sb->s_blocksize_bits;
     }
-    brelse(bh);
-    printk(KERN_INFO "Iterate finish\n");
     return 0;
-
-
-
 }
 
 /*
  *  Operaciones sobre inodos
  */
 
-struct assoofs_inode_info *assoofs_get_inode_info(struct super_block *sb, uint64_t inode_no);
+int assoofs_get_inode_info(struct super_block *sb, uint64_t inode_no, struct assoofs_inode_info *inode_info);
 
-static struct inode *assoofs_get_inode(struct super_block *sb, int ino);
+static struct inode *assoofs_iget(struct super_block *sb, unsigned long ino);
 
 static int assoofs_create(struct inode *dir, struct dentry *dentry, umode_t mode, bool excl);
 
@@ -147,50 +2604,78 @@ struct dentry *assoofs_lookup(struct inode *parent_inode, struct dentry *child_d
 
 static int assoofs_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode);
 
-int assoofs_sb_get_a_freeblock(struct super_block *sb, uint64_t *block);
+static int assoofs_unlink(struct inode *dir, struct dentry *dentry);
 
-void assoofs_save_sb_info(struct super_block *vsb);
+static int assoofs_rmdir(struct inode *dir, struct dentry *dentry);
 
-void assoofs_add_inode_info(struct super_block *sb, struct assoofs_inode_info *inode);
+static int assoofs_setattr(struct dentry *dentry, struct iattr *attr);
 
+static void assoofs_mark_sb_dirty(struct super_block *sb);
 
+static int assoofs_write_inode_slot(struct inode *inode, int sync);
 
-struct assoofs_inode_info *assoofs_search_inode_info(struct super_block *sb, struct assoofs_inode_info *start, struct assoofs_inode_info *search);
+static int assoofs_new_inode_no(struct inode *dir, umode_t mode, uint64_t *inode_no);
+
+
+static uint64_t assoofs_inodes_max(struct super_block *sb);
+
+struct buffer_head *assoofs_inode_slot(struct super_block *sb, uint64_t inode_no, struct assoofs_inode_info **slot);
 
 
 static struct inode_operations assoofs_inode_ops = {
     .create = assoofs_create,
     .lookup = assoofs_lookup,
     .mkdir = assoofs_mkdir,
+    .unlink = assoofs_unlink,
+    .rmdir = assoofs_rmdir,
+    .setattr = assoofs_setattr,
 };
 
 
-static struct inode *assoofs_get_inode(struct super_block *sb, int ino){
+/*
+ * Devuelve el inodo ino con una referencia. Los inodos vivos se buscan en la
+ * tabla hash de la VFS (iget_locked), asi que abrir o recorrer varias veces el
+ * mismo fichero no vuelve a leer la tabla de inodos y todos los dentries que
+ * apuntan a el comparten el mismo struct inode. Solo un inodo nuevo (I_NEW) se
+ * rellena a partir del disco.
+ */
+static struct inode *assoofs_iget(struct super_block *sb, unsigned long ino){
     struct inode *inode;
     struct assoofs_inode_info *inode_info;
+    int ret;
+
+    inode = iget_locked(sb, ino);
+    if (!inode)
+        return ERR_PTR(-ENOMEM);
+    trace_assoofs_iget(sb, ino, !(inode->i_state & I_NEW));
+    if (!(inode->i_state & I_NEW)) {
+        assoofs_stat_inc(sb, ASSOOFS_STAT_ICACHE_HITS);
+        return inode;
+    }
+    assoofs_stat_inc(sb, ASSOOFS_STAT_ICACHE_MISSES);
 
-    printk(KERN_INFO "assoofs_get_inode request");
-
-    inode_info = assoofs_get_inode_info(sb,ino);
+    inode_info = &ASSOOFS_I(inode)->info;
+    ret = assoofs_get_inode_info(sb, ino, inode_info);
+    if (ret) {
+        iget_failed(inode);
+        return ERR_PTR(ret);
+    }
 
-    inode = new_inode(sb);
-    
-    inode->i_ino = ino;
-    inode->i_sb = sb;
+    inode_init_owner(inode, NULL, inode_info->mode);
     inode->i_op = &assoofs_inode_ops;
     
-    printk(KERN_INFO "new inode created");
     if (S_ISDIR(inode_info->mode))
         inode->i_fop = &assoofs_dir_operations;
-    else if (S_ISREG(inode_info->mode))
+    else if (S_ISREG(inode_info->mode)) {
         inode->i_fop = &assoofs_file_operations;
-    else
+        inode->i_mapping->a_ops = &assoofs_aops;
+        inode->i_size = inode_info->file_size;
+    } else
         printk(KERN_ERR "Unknown inode type. Neither a directory nor a file.");
 
     
     inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode);
-    inode-> i_private = inode_info;
-    printk(KERN_INFO "assoofs_get_inode finsih");
+    unlock_new_inode(inode);
     return inode;
 
 }
@@ -200,34 +2685,36 @@ static struct inode *assoofs_get_inode(struct super_block *sb, int ino){
 
 
 struct dentry *assoofs_lookup(struct inode *parent_inode, struct dentry *child_dentry, unsigned int flags) {
-    int i;
-    struct assoofs_inode_info *parent_info = parent_inode->i_private;
+    struct assoofs_inode_info *parent_info = &ASSOOFS_I(parent_inode)->info;
     struct super_block *sb = parent_inode->i_sb;
-    struct buffer_head *bh;
-    struct assoofs_dir_record_entry *record;
-
-    printk(KERN_INFO "Lookup request\n");
-    
- 
-    
-    bh = sb_bread(sb, parent_info->data_block_number);
-
-    record = (struct assoofs_dir_record_entry *)bh->b_data;
-   
-    printk(KERN_INFO "Lookup in inode %lld, block %llu\n ",record->inode_no, parent_info->data_block_number);
-    printk(KERN_INFO "Parent has %lld",parent_info->dir_children_count);
-    for (i=0; i < parent_info->dir_children_count; i++) {
-        if (!strcmp(record->filename, child_dentry->d_name.name)) {
-            struct inode *inode = assoofs_get_inode(sb, record->inode_no); // Funcion auxiliar que obtine la informacion de un inodo a partir de su numero de inodo.
-            inode_init_owner(inode, parent_inode, ((struct assoofs_inode_info *)inode->i_private)->mode);
-            d_add(child_dentry, inode);
-            printk("%s file founded (ino = %lld)",record->filename ,record->inode_no );
-            return NULL;
-        }
-        record++;
+    const char *name = child_dentry->d_name.name;
+    unsigned int len = child_dentry->d_name.len;
+    uint64_t inode_no;
+    bool found;
+    u64 start = ktime_get_ns();
+
+    if (child_dentry->d_name.len > ASSOOFS_FILENAME_MAXLEN)
+        return ERR_PTR(-ENAMETOOLONG);
+
+    assoofs_stat_inc(sb, ASSOOFS_STAT_LOOKUPS);
+    found = assoofs_dcache_lookup(parent_inode, name, len, &inode_no);
+    if (!found && !assoofs_dcache_build(parent_inode))
+        found = assoofs_dcache_lookup(parent_inode, name, len, &inode_no);
+    // Sin cache (no habia memoria o el shrinker se la ha llevado ya) se busca en el indice del directorio
+    if (!found)
+        inode_no = assoofs_dir_find_entry(sb, parent_info, name, len);
+    trace_assoofs_lookup(parent_inode, child_dentry, inode_no);
+    assoofs_hist_since(sb, ASSOOFS_HIST_LOOKUP, start);
+    if (inode_no) {
+        struct inode *inode = assoofs_iget(sb, inode_no); // Inodo en cache o, si no esta, leido de la tabla de inodos
+        if (IS_ERR(inode))
+            return ERR_CAST(inode);
+        return d_splice_alias(inode, child_dentry);
     }
 
-    printk(KERN_ERR "No inode found for the filename");
+    // Dentry negativo: las siguientes busquedas del mismo nombre no llegan aqui
+    assoofs_stat_inc(sb, ASSOOFS_STAT_LOOKUP_MISSES);
+    d_add(child_dentry, NULL);
     return NULL;
 }
 
@@ -236,260 +2723,1408 @@ struct dentry *assoofs_lookup(struct inode *parent_inode, struct dentry *child_d
 
 
 
+/*
+ * Termina un alta: si ha ido bien el dentry negativo que dejo lookup pasa a
+ * apuntar al inodo nuevo; si no, el inodo se suelta sin enlaces y
+ * assoofs_evict_inode devuelve su numero y lo que ya tuviera reservado. Se
+ * llama con el handle del alta ya cerrado, porque el borrado abre el suyo.
+ */
+static int assoofs_finish_create(struct dentry *dentry, struct inode *inode, int ret) {
+    if (ret) {
+        clear_nlink(inode);
+        iput(inode);
+        return ret;
+    }
+    d_instantiate(dentry, inode);
+    return 0;
+}
+
 static int assoofs_create(struct inode *dir, struct dentry *dentry, umode_t mode, bool excl) {
     struct inode *inode;
-    uint64_t count;
+    uint64_t inode_no;
     struct assoofs_inode_info *inode_info;
-    struct assoofs_inode_info *parent_inode_info;
-    struct assoofs_dir_record_entry *dir_contents;
-    struct buffer_head *bh;
     struct super_block *sb = dir->i_sb; // obtengo un puntero al superbloque desde dir
+    handle_t *handle;
+    int ret, err;
+
+    inode = new_inode(sb);
+    if (!inode)
+        return -ENOMEM;
+
+    // Toda el alta (entrada del inodo y del directorio) va en la misma transaccion
+    handle = assoofs_journal_start(sb, ASSOOFS_CREATE_CREDITS);
+    if (IS_ERR(handle)) {
+        iput(inode); // Sin numero todavia: no hay nada que borrar
+        return PTR_ERR(handle);
+    }
+
+    ret = assoofs_new_inode_no(dir, mode, &inode_no);
+    if (ret) {
+        assoofs_journal_stop(handle);
+        iput(inode);
+        return ret;
+    }
+
+    inode->i_ino = inode_no; // Numero reservado en el mapa de inodos
+    inode_init_owner(inode, dir, mode);
+    inode->i_op = &assoofs_inode_ops;
+    inode->i_fop = &assoofs_file_operations;
+    inode->i_mapping->a_ops = &assoofs_aops;
+    inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode);
+
+    inode_info = &ASSOOFS_I(inode)->info; // Ya viene a cero de assoofs_alloc_inode
+    inode_info->mode = mode; // El segundo mode me llega como argumento
+    inode_info->file_size = 0;
+    inode_info->inode_no = inode->i_ino;
+    inode_info->flags = ASSOOFS_INODE_INLINE_DATA; // Vacio: no ocupa bloques hasta que supere ASSOOFS_INLINE_DATA_MAX
+    insert_inode_hash(inode);
+
+    ret = assoofs_write_inode_slot(inode, 0);
+    trace_assoofs_create(dir, inode);
+    if (!ret)
+        ret = assoofs_dir_add_entry(dir, dentry->d_name.name, dentry->d_name.len, inode_info->inode_no, inode_info->mode);
+    err = assoofs_journal_stop(handle);
+    return assoofs_finish_create(dentry, inode, ret ? ret : err);
+}
 
-    printk(KERN_INFO "New file request\n");
-    count = ((struct assoofs_super_block_info *)sb->s_fs_info)->inodes_count; // obtengo el numero de inodos de la informacion persistente del superbloque
+static int assoofs_mkdir(struct inode *dir , struct dentry *dentry, umode_t mode) {
+    struct inode *inode;
+    uint64_t inode_no;
+    struct assoofs_inode_info *inode_info;
+    struct super_block *sb = dir->i_sb; // obtengo un puntero al superbloque desde dir
+    handle_t *handle;
+    int ret, err;
 
     inode = new_inode(sb);
+    if (!inode)
+        return -ENOMEM;
+
+    handle = assoofs_journal_start(sb, ASSOOFS_CREATE_CREDITS);
+    if (IS_ERR(handle)) {
+        iput(inode);
+        return PTR_ERR(handle);
+    }
+
+    ret = assoofs_new_inode_no(dir, S_IFDIR | mode, &inode_no);
+    if (ret) {
+        assoofs_journal_stop(handle);
+        iput(inode);
+        return ret;
+    }
+
+    inode->i_ino = inode_no; // Numero reservado en el mapa de inodos
+    inode_init_owner(inode, dir, S_IFDIR | mode);
+    inode->i_op = &assoofs_inode_ops;
+    inode->i_fop = &assoofs_dir_operations;
+    inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode);
+
+    inode_info = &ASSOOFS_I(inode)->info; // Ya viene a cero de assoofs_alloc_inode
+    inode_info->dir_children_count = 0;
+    inode_info->mode = S_IFDIR | mode; // El segundo mode me llega como argumento
+    inode_info->inode_no = inode->i_ino;
+    insert_inode_hash(inode);
+
+    ret = assoofs_dir_init(inode); // Indice y primera hoja del directorio nuevo
+    if (!ret)
+        ret = assoofs_write_inode_slot(inode, 0);
+    trace_assoofs_create(dir, inode);
+    if (!ret)
+        ret = assoofs_dir_add_entry(dir, dentry->d_name.name, dentry->d_name.len, inode_info->inode_no, inode_info->mode);
+    err = assoofs_journal_stop(handle);
+    return assoofs_finish_create(dentry, inode, ret ? ret : err);
+}
+
+/*
+ * Quita la entrada de dentry de dir y el enlace que tenia el inodo. Sus bloques
+ * y su numero no se liberan hasta que se suelte la ultima referencia
+ * (assoofs_evict_inode): un fichero abierto se sigue pudiendo leer.
+ */
+static int assoofs_remove_link(struct inode *dir, struct dentry *dentry) {
+    struct inode *inode = d_inode(dentry);
+    handle_t *handle;
+    int ret, err;
+
+    handle = assoofs_journal_start(dir->i_sb, ASSOOFS_UNLINK_CREDITS);
+    if (IS_ERR(handle))
+        return PTR_ERR(handle);
+    ret = assoofs_dir_remove_entry(dir, dentry->d_name.name, dentry->d_name.len, inode->i_ino);
+    if (!ret) {
+        inode->i_ctime = dir->i_ctime;
+        if (S_ISDIR(inode->i_mode))
+            clear_nlink(inode);
+        else
+            drop_nlink(inode);
+        mark_inode_dirty(inode);
+    }
+    err = assoofs_journal_stop(handle);
+    return ret ? ret : err;
+}
+
+static int assoofs_unlink(struct inode *dir, struct dentry *dentry) {
+    return assoofs_remove_link(dir, dentry);
+}
+
+static int assoofs_rmdir(struct inode *dir, struct dentry *dentry) {
+    if (ASSOOFS_I(d_inode(dentry))->info.dir_children_count)
+        return -ENOTEMPTY;
+    return assoofs_remove_link(dir, dentry);
+}
+
+/*
+ * Cambios de atributos. Solo el modo y el tamano se guardan en la entrada del
+ * inodo; cambiar el tamano libera o deja como hueco el final del fichero.
+ */
+static int assoofs_setattr(struct dentry *dentry, struct iattr *attr) {
+    struct inode *inode = d_inode(dentry);
+    struct assoofs_inode *ai = ASSOOFS_I(inode);
+    int ret;
+
+    ret = setattr_prepare(dentry, attr);
+    if (ret)
+        return ret;
+
+    if ((attr->ia_valid & ATTR_SIZE) && attr->ia_size != i_size_read(inode)) {
+        if (!S_ISREG(inode->i_mode))
+            return -EINVAL;
+        ret = assoofs_truncate(inode, attr->ia_size);
+        if (ret)
+            return ret;
+    }
+
+    setattr_copy(inode, attr);
+    if (attr->ia_valid & ATTR_MODE) {
+        assoofs_down_write(inode->i_sb, &ai->i_data_sem);
+        ai->info.mode = inode->i_mode;
+        up_write(&ai->i_data_sem);
+    }
+    mark_inode_dirty(inode);
+    return 0;
+}
+
+/*
+ * Mapa en memoria de lo que los lotes tienen apartado en group, el de bloques o
+ * el de inodos. Se lee y se cambia bajo el cerrojo del grupo.
+ */
+static inline unsigned long *assoofs_reserved_map(struct super_block *sb, uint64_t group, bool inodes) {
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    unsigned long *map = READ_ONCE(sbi->s_groups[group].reserved);
+
+    if (map && inodes)
+        map += BITS_TO_LONGS(sbi->s_asb->blocks_per_group);
+    return map;
+}
+
+// Crea el mapa de apartados de group la primera vez que un lote se rellena en el
+static int assoofs_alloc_reserved_map(struct super_block *sb, uint64_t group) {
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    struct assoofs_group_info *gi = &sbi->s_groups[group];
+    unsigned long *map;
+
+    if (READ_ONCE(gi->reserved))
+        return 0;
+    map = kcalloc(BITS_TO_LONGS(sbi->s_asb->blocks_per_group) + BITS_TO_LONGS(sbi->s_asb->inodes_per_group),
+                  sizeof(*map), GFP_NOFS);
+    if (!map)
+        return -ENOMEM;
+    if (cmpxchg(&gi->reserved, NULL, map)) // Otra CPU lo ha creado a la vez
+        kfree(map);
+    return 0;
+}
+
+/*
+ * Busca en el bloque bh del mapa de bits, a partir del bit from, una racha de
+ * hasta max bits libres. Devuelve su primer bit (limit si no hay ninguna) y en
+ * *end el siguiente al ultimo. Con diario un bit solo esta libre si tambien lo
+ * estaba al confirmarse la ultima transaccion (b_committed_data, que deja
+ * assoofs_sb_free_blocks): un bloque liberado no se reutiliza mientras una
+ * caida pueda devolverselo a su antiguo dueno con los datos del nuevo. Si se
+ * pasa reserved, tampoco se da lo que tiene apartado algun lote.
+ */
+static unsigned long assoofs_find_free_run(struct buffer_head *bh, const unsigned long *reserved, unsigned long limit, unsigned long from, uint32_t max, unsigned long *end) {
+    struct journal_head *jh = NULL;
+    char *committed = NULL;
+    unsigned long bit = from;
+
+    // bh ya tiene write access en este handle: su journal_head no desaparece
+    if (buffer_jbd(bh)) {
+        jh = bh2jh(bh);
+        spin_lock(&jh->b_state_lock);
+        committed = jh->b_committed_data;
+    }
+    while ((bit = find_next_zero_bit_le(bh->b_data, limit, bit)) < limit) {
+        if (committed && test_bit_le(bit, committed))
+            bit = find_next_zero_bit_le(committed, limit, bit);
+        else if (reserved && test_bit(bit, reserved))
+            bit = find_next_zero_bit(reserved, limit, bit);
+        else
+            break;
+    }
+    if (bit < limit) {
+        *end = find_next_bit_le(bh->b_data, min_t(unsigned long, limit, bit + max), bit);
+        if (committed)
+            *end = find_next_bit_le(committed, *end, bit);
+        if (reserved)
+            *end = find_next_bit(reserved, *end, bit);
+    }
+    if (jh)
+        spin_unlock(&jh->b_state_lock);
+    return bit;
+}
+
+/*
+ * Busca hasta *count bloques contiguos (como minimo uno) lo mas cerca posible
+ * de goal y devuelve en *count cuantos se han conseguido. Se empieza en el
+ * grupo de goal, por el propio goal, y se sigue por los siguientes saltando
+ * los que estan llenos sin leer su mapa de bits. Dentro de un grupo el mapa se
+ * recorre palabra a palabra. Las rachas no cruzan de un grupo al siguiente.
+ * Con reserve la racha solo se aparta para un lote: no se marca en el mapa de
+ * bits ni se descuenta de los contadores.
+ */
+static int assoofs_find_freeblocks(struct super_block *sb, uint64_t goal, bool reserve, uint64_t *block, uint32_t *count){
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    struct assoofs_super_block_info *assoofs_sb = sbi->s_asb;
+    struct buffer_head *bh;
+    uint64_t bits_per_block = assoofs_sb->blocks_per_group;
+    uint64_t i, scanned;
+    unsigned long limit, bit, end, j, *reserved;
+    u64 t0 = ktime_get_ns();
+    int ret;
+
+    assoofs_stat_inc(sb, ASSOOFS_STAT_ALLOCS);
+    // La lectura rapida puede quedarse corta por lo que acumula cada CPU: ante un cero se suma de verdad
+    if (!percpu_counter_read_positive(&sbi->s_freeblocks_counter) &&
+        !percpu_counter_sum_positive(&sbi->s_freeblocks_counter))
+        goto out_nospc;
+
+    if (goal >= assoofs_sb->blocks_count)
+        goal = 0;
+
+    // Se da una vuelta completa y se vuelve al grupo de partida para mirar lo que habia antes de goal
+    for (scanned = 0; scanned <= assoofs_sb->groups_count; scanned++) {
+        i = (goal / bits_per_block + scanned) % assoofs_sb->groups_count;
+        if (atomic_read(&assoofs_group(sb, i)->free_blocks) <= 0)
+            continue;
+        limit = min(bits_per_block, assoofs_sb->blocks_count - i * bits_per_block);
+        if (reserve && (ret = assoofs_alloc_reserved_map(sb, i)))
+            return ret;
+
+        assoofs_stat_inc(sb, ASSOOFS_STAT_ALLOC_SCANNED);
+        assoofs_stat_inc(sb, ASSOOFS_STAT_META_READS);
+        bh = assoofs_bread_ahead(sb, assoofs_sb->bitmap_block + i, assoofs_sb->bitmap_block + assoofs_sb->bitmap_blocks);
+        if (!bh)
+            return -EIO;
+        ret = assoofs_journal_get_write_access(sb, bh); // Puede dormir: fuera del spinlock
+        if (ret) {
+            brelse(bh);
+            return ret;
+        }
 
-    inode->i_ino = count + 1; // Asigno numero al nuevo inodo a partir de count
+        // Cada grupo tiene su cerrojo: reservas en zonas distintas no se esperan
+        assoofs_spin_lock(sb, bgl_lock_ptr(&sbi->s_bgl, i));
+        reserved = assoofs_reserved_map(sb, i, false);
+        bit = assoofs_find_free_run(bh, reserved, limit, scanned ? 0 : goal % bits_per_block, *count, &end);
+        if (bit >= limit) {
+            spin_unlock(bgl_lock_ptr(&sbi->s_bgl, i));
+            brelse(bh);
+            continue;
+        }
 
-    if(inode->i_ino >= ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED){
-        printk(KERN_ERR "File can be created Max filesystem objects are reached");
-        return -1;
+        if (reserve) {
+            bitmap_set(reserved, bit, end - bit);
+            spin_unlock(bgl_lock_ptr(&sbi->s_bgl, i));
+            brelse(bh);
+            *block = i * bits_per_block + bit;
+            *count = end - bit;
+            return 0;
+        }
+        for (j = bit; j < end; j++)
+            __set_bit_le(j, bh->b_data); // MARCAR LOS BLOQUES COMO OCUPADOS
+        spin_unlock(bgl_lock_ptr(&sbi->s_bgl, i));
+        ret = assoofs_journal_dirty_metadata(sb, NULL, bh); // Sin diario lo escribe la writeback o sync_fs, no cada reserva
+        brelse(bh);
+        if (ret)
+            return ret;
+
+        *block = i * bits_per_block + bit;
+        *count = end - bit;
+
+        percpu_counter_sub(&sbi->s_freeblocks_counter, *count);
+        atomic_sub(*count, &assoofs_group(sb, i)->free_blocks);
+        assoofs_mark_sb_dirty(sb);
+        trace_assoofs_alloc_blocks(sb, goal, *block, *count, scanned + 1);
+        assoofs_hist_since(sb, ASSOOFS_HIST_ALLOC, t0);
+        return 0;
     }
-   
-    inode_init_owner(inode, dir, mode);
 
-    inode-> i_sb = sb;
-    inode->i_op = &assoofs_inode_ops;
-    inode->i_fop = &assoofs_file_operations;
-    inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode);
+out_nospc:
+    return -ENOSPC;
+}
 
+static bool assoofs_drain_pools(struct super_block *sb);
 
-    inode_info = kmem_cache_alloc(assoofs_inode_cache, GFP_KERNEL);
-    inode_info->mode = mode; // El segundo mode me llega como argumento
-    inode_info->file_size = 0;
-    inode->i_private = inode_info;
-    
+/*
+ * Reserva hasta *count bloques contiguos lo mas cerca posible de goal, ver
+ * assoofs_find_freeblocks. Si no queda ninguno fuera de los lotes, se
+ * deshacen los lotes y se vuelve a buscar.
+ */
+int assoofs_sb_get_freeblocks(struct super_block *sb, uint64_t goal, uint64_t *block, uint32_t *count){
+    int ret = assoofs_find_freeblocks(sb, goal, false, block, count);
 
-    inode_info->inode_no = inode->i_ino;
-    
-    d_add(dentry, inode);
+    if (ret == -ENOSPC && assoofs_drain_pools(sb))
+        ret = assoofs_find_freeblocks(sb, goal, false, block, count);
+    return ret;
+}
 
-    assoofs_sb_get_a_freeblock(sb, &inode_info->data_block_number);
+int assoofs_sb_get_a_freeblock(struct super_block *sb, uint64_t goal, uint64_t *block){
+    uint32_t count = 1;
 
-    assoofs_add_inode_info(sb, inode_info);
+    return assoofs_sb_get_freeblocks(sb, goal, block, &count);
+}
 
-    parent_inode_info = dir->i_private;
-    bh = sb_bread(sb, parent_inode_info->data_block_number);
+/*
+ * Pasa del lote al mapa de bits de group, con inodes el de inodos, hasta
+ * *count entradas desde el bit bit y deja en *count cuantas. Las entradas
+ * salen del mapa de apartados y se descuentan de los contadores. Devuelve
+ * -EBUSY si bit ya esta ocupado en disco. El handle del llamante cuenta con un
+ * credito para el mapa.
+ */
+static int assoofs_claim(struct super_block *sb, uint64_t group, bool inodes, unsigned long bit, uint32_t *count){
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    struct assoofs_super_block_info *assoofs_sb = sbi->s_asb;
+    struct buffer_head *bh;
+    unsigned long limit, end, j;
+    int ret;
 
-    dir_contents = (struct assoofs_dir_record_entry *)bh->b_data;
-    dir_contents += parent_inode_info->dir_children_count;
-    dir_contents->inode_no = inode_info->inode_no; // inode_info es la informacion persistente del inodo creado en el paso 2.
+    if (inodes)
+        limit = assoofs_sb->inodes_per_group;
+    else
+        limit = min(assoofs_sb->blocks_per_group, assoofs_sb->blocks_count - group * assoofs_sb->blocks_per_group);
+    assoofs_stat_inc(sb, ASSOOFS_STAT_META_READS);
+    bh = sb_bread(sb, (inodes ? assoofs_sb->inode_bitmap_block : assoofs_sb->bitmap_block) + group);
+    if (!bh)
+        return -EIO;
+    ret = assoofs_journal_get_write_access(sb, bh);
+    if (ret) {
+        brelse(bh);
+        return ret;
+    }
 
-    strcpy(dir_contents->filename, dentry->d_name.name);
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
+    assoofs_spin_lock(sb, bgl_lock_ptr(&sbi->s_bgl, group));
+    // Sin mapa de apartados: lo que se busca es justo lo que este lote tiene apartado
+    if (assoofs_find_free_run(bh, NULL, limit, bit, *count, &end) != bit) {
+        spin_unlock(bgl_lock_ptr(&sbi->s_bgl, group));
+        brelse(bh);
+        return -EBUSY;
+    }
+    for (j = bit; j < end; j++)
+        __set_bit_le(j, bh->b_data);
+    bitmap_clear(assoofs_reserved_map(sb, group, inodes), bit, end - bit);
+    spin_unlock(bgl_lock_ptr(&sbi->s_bgl, group));
+    ret = assoofs_journal_dirty_metadata(sb, NULL, bh);
     brelse(bh);
+    if (ret)
+        return ret;
+
+    *count = end - bit;
+    if (inodes) {
+        percpu_counter_sub(&sbi->s_freeinodes_counter, *count);
+        atomic_sub(*count, &assoofs_group(sb, group)->free_inodes);
+    } else {
+        percpu_counter_sub(&sbi->s_freeblocks_counter, *count);
+        atomic_sub(*count, &assoofs_group(sb, group)->free_blocks);
+    }
+    assoofs_mark_sb_dirty(sb);
+    return 0;
+}
 
-    mutex_lock_interruptible(&assoofs_inodes_mgmt_lock);
+// Devuelve al grupo lo que el lote tiene apartado desde bit, sin tocar el disco
+static void assoofs_unreserve(struct super_block *sb, uint64_t group, bool inodes, unsigned long bit, uint32_t count){
+    spinlock_t *lock = bgl_lock_ptr(&ASSOOFS_SB(sb)->s_bgl, group);
+
+    assoofs_spin_lock(sb, lock);
+    bitmap_clear(assoofs_reserved_map(sb, group, inodes), bit, count);
+    spin_unlock(lock);
+}
 
-    parent_inode_info->dir_children_count++;
-    assoofs_save_inode_info(sb, parent_inode_info);
+/*
+ * Saca bloques del lote de esta CPU si el lote empieza justo en goal (el
+ * fichero sigue contiguo) o, con first, para el primer bloque de un fichero.
+ * Un lote vacio solo se rellena, cerca de goal, para un primer bloque: asi los
+ * ficheros pequenos que crea cada CPU quedan juntos y seguidos. Si lo apartado
+ * ya no se puede usar, el lote se deshace y se reserva por la via normal.
+ */
+static bool assoofs_pool_get_blocks(struct super_block *sb, uint64_t goal, bool first, uint64_t *block, uint32_t *count){
+    struct assoofs_pool *pool = raw_cpu_ptr(ASSOOFS_SB(sb)->s_pools);
+    uint64_t bits_per_block = ASSOOFS_SB(sb)->s_asb->blocks_per_group;
+    uint32_t n = ASSOOFS_POOL_BLOCKS;
+    bool got = false;
+
+    mutex_lock(&pool->lock);
+    if (!pool->blocks && first && !assoofs_find_freeblocks(sb, goal, true, &pool->block, &n))
+        pool->blocks = n;
+    if (pool->blocks && (first || goal == pool->block)) {
+        *count = min(*count, pool->blocks);
+        if (!assoofs_claim(sb, pool->block / bits_per_block, false, pool->block % bits_per_block, count)) {
+            *block = pool->block;
+            pool->block += *count;
+            pool->blocks -= *count;
+            got = true;
+        } else {
+            assoofs_unreserve(sb, pool->block / bits_per_block, false, pool->block % bits_per_block, pool->blocks);
+            pool->blocks = 0;
+        }
+    }
+    mutex_unlock(&pool->lock);
+    return got;
+}
 
-    mutex_unlock(&assoofs_inodes_mgmt_lock);
+/*
+ * Reserva hasta *count bloques para el bloque logico file_block de inode,
+ * contiguos a los que ya tiene si se puede. Los ficheros pequenos tiran del
+ * lote de su CPU, que no hay que buscar en el mapa de bits de un grupo
+ * compartido por todas las altas que se hacen a la vez. El llamante tiene
+ * i_data_sem.
+ */
+static int assoofs_new_blocks(struct inode *inode, uint32_t file_block, uint64_t *block, uint32_t *count){
+    struct super_block *sb = inode->i_sb;
+    uint64_t goal = assoofs_block_goal(inode, file_block);
+    bool first = !ASSOOFS_I(inode)->info.extents_count;
 
-    return 0;
+    if (*count <= ASSOOFS_POOL_BLOCKS && assoofs_pool_get_blocks(sb, goal, first, block, count))
+        return 0;
+    return assoofs_sb_get_freeblocks(sb, goal, block, count);
 }
 
-static int assoofs_mkdir(struct inode *dir , struct dentry *dentry, umode_t mode) {
-    struct inode *inode;
-    uint64_t count;
-    struct assoofs_inode_info *inode_info;
-    struct assoofs_inode_info *parent_inode_info;
-    struct assoofs_dir_record_entry *dir_contents;
+/*
+ * Marca como libres los bloques [block, block + count) dentro del handle
+ * abierto, que se amplia con un credito por cada bloque del mapa de bits.
+ */
+int assoofs_sb_free_blocks(struct super_block *sb, uint64_t block, uint32_t count){
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    struct assoofs_super_block_info *assoofs_sb = sbi->s_asb;
     struct buffer_head *bh;
-    struct super_block *sb; // obtengo un puntero al superbloque desde dir
+    uint64_t bits_per_block = sb->s_blocksize * 8;
+    uint64_t i;
+    unsigned long bit, n, j;
+    int ret;
+
+    if (block + count > assoofs_sb->blocks_count) {
+        printk(KERN_ERR "Freeing blocks %llu-%llu past the end of the volume", block, block + count - 1);
+        return -EIO;
+    }
 
-    printk(KERN_INFO "New mkdir request\n");
-    sb = dir->i_sb;
-    count = ((struct assoofs_super_block_info *)sb->s_fs_info)->inodes_count; // obtengo el numero de inodos de la informacion persistente del superbloque
+    while (count) {
+        i = block / bits_per_block;
+        bit = block % bits_per_block;
+        n = min_t(uint64_t, count, bits_per_block - bit);
+
+        ret = assoofs_journal_ensure_credits(sb, 1, 0);
+        if (ret)
+            return ret;
+        assoofs_stat_inc(sb, ASSOOFS_STAT_META_READS);
+        bh = sb_bread(sb, assoofs_sb->bitmap_block + i);
+        if (!bh)
+            return -EIO;
+        ret = assoofs_journal_get_undo_access(sb, bh);
+        if (!ret) {
+            assoofs_spin_lock(sb, bgl_lock_ptr(&sbi->s_bgl, i));
+            for (j = bit; j < bit + n; j++)
+                __clear_bit_le(j, bh->b_data);
+            spin_unlock(bgl_lock_ptr(&sbi->s_bgl, i));
+            ret = assoofs_journal_dirty_metadata(sb, NULL, bh);
+        }
+        brelse(bh);
+        if (ret)
+            return ret;
+
+        percpu_counter_add(&sbi->s_freeblocks_counter, n);
+        atomic_add(n, &assoofs_group(sb, i)->free_blocks);
+        block += n;
+        count -= n;
+    }
+    assoofs_mark_sb_dirty(sb);
+    return 0;
+}
 
-    inode = new_inode(sb);
+// Copia los contadores de los grupos a sus descriptores, dentro del handle abierto
+static int assoofs_commit_group_descs(struct super_block *sb){
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    uint64_t per_block = sb->s_blocksize / sizeof(struct assoofs_group_desc);
+    struct assoofs_group_desc *desc;
+    struct assoofs_group_info *group;
+    struct buffer_head *bh;
+    uint64_t i, g;
+    int ret;
+
+    for (i = 0; i < sbi->s_asb->group_desc_blocks; i++) {
+        bh = smp_load_acquire(&sbi->s_group_desc[i]);
+        if (IS_ERR_OR_NULL(bh)) // Sin cargar: sus grupos no han cambiado desde el montaje
+            continue;
+        ret = assoofs_journal_get_write_access(sb, bh);
+        if (ret)
+            return ret;
+        lock_buffer(bh);
+        desc = (struct assoofs_group_desc *)bh->b_data;
+        for (g = i * per_block; g < sbi->s_asb->groups_count && g < (i + 1) * per_block; g++, desc++) {
+            group = &sbi->s_groups[g]; // Cargado: su bloque esta en s_group_desc
+            desc->free_blocks_count = max(atomic_read(&group->free_blocks), 0);
+            desc->free_inodes_count = max(atomic_read(&group->free_inodes), 0);
+            desc->dirs_count = max(atomic_read(&group->dirs), 0);
+        }
+        unlock_buffer(bh);
+        ret = assoofs_journal_dirty_metadata(sb, NULL, bh);
+        if (ret)
+            return ret;
+    }
+    return 0;
+}
 
-    inode_init_owner(inode, dir, S_IFDIR | mode);
+/*
+ * Copia los contadores en memoria al superbloque y a los descriptores de
+ * grupo, en una transaccion propia si hay diario; con wait, ademas espera a
+ * que lleguen al disco. La cuenta de bloques libres es la suma exacta de todas
+ * las CPUs.
+ */
+static int assoofs_commit_super(struct super_block *sb, int wait){
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    struct assoofs_super_block_info *assoofs_sb = sbi->s_asb;
+    handle_t *handle;
+    uint64_t i;
+    tid_t target;
+    int ret, err;
+
+    if (sb_rdonly(sb))
+        return 0;
 
-    inode->i_ino = count + 1; // Asigno numero al nuevo inodo a partir de count
-    if(inode->i_ino >= ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED){
-        printk(KERN_ERR "directory can be created Max filesystem objects are reached");
-        return -1;
+    handle = assoofs_journal_start(sb, 1 + assoofs_sb->group_desc_blocks);
+    if (IS_ERR(handle))
+        return PTR_ERR(handle);
+    ret = assoofs_journal_get_write_access(sb, sbi->s_sbh);
+    if (ret) {
+        assoofs_journal_stop(handle);
+        return ret;
     }
 
-    inode->i_sb = sb;
-    inode->i_op = &assoofs_inode_ops;
-    inode->i_fop = &assoofs_dir_operations;
-    inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode);
-
-    inode_info = kmem_cache_alloc(assoofs_inode_cache, GFP_KERNEL);
-    inode_info->dir_children_count = 0;
-    inode_info->mode = S_IFDIR | mode; // El segundo mode me llega como argumento
-    inode_info->file_size = 0;
-    inode_info->inode_no = inode->i_ino;
+    clear_bit(ASSOOFS_SB_DIRTY, &sbi->s_flags);
+    lock_buffer(sbi->s_sbh);
+    assoofs_sb->inodes_count = assoofs_inodes_max(sb) - percpu_counter_sum_positive(&sbi->s_freeinodes_counter);
+    assoofs_sb->free_blocks_count = percpu_counter_sum_positive(&sbi->s_freeblocks_counter);
+    assoofs_sb->dirs_count = percpu_counter_sum_positive(&sbi->s_dirs_counter);
+    unlock_buffer(sbi->s_sbh);
+    ret = assoofs_journal_dirty_metadata(sb, NULL, sbi->s_sbh);
+    if (!ret)
+        ret = assoofs_commit_group_descs(sb);
+    err = assoofs_journal_stop(handle);
+    if (!ret)
+        ret = err;
+
+    if (ret || !wait)
+        return ret;
+    if (!sbi->s_journal) {
+        for (i = 0; !ret && i < assoofs_sb->group_desc_blocks; i++)
+            if (!IS_ERR_OR_NULL(sbi->s_group_desc[i]))
+                ret = sync_dirty_buffer(sbi->s_group_desc[i]);
+        return ret ? ret : sync_dirty_buffer(sbi->s_sbh);
+    }
+    if (jbd2_journal_start_commit(sbi->s_journal, &target))
+        return jbd2_log_wait_commit(sbi->s_journal, target);
+    return 0;
+}
 
-    inode->i_private = inode_info;
+static void assoofs_commit_work(struct work_struct *work){
+    struct assoofs_sb_info *sbi = container_of(to_delayed_work(work), struct assoofs_sb_info, s_commit_work);
 
+    assoofs_commit_super(sbi->s_sb, 0); // La escritura del buffer queda para la writeback del dispositivo
+}
 
-    d_add(dentry, inode);
+/*
+ * Anota que los contadores han cambiado. Solo el primer cambio desde la ultima
+ * copia programa el trabajo, asi que una rafaga de altas acaba en una sola
+ * actualizacion del superbloque.
+ */
+static void assoofs_mark_sb_dirty(struct super_block *sb){
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
 
-    assoofs_sb_get_a_freeblock(sb, &inode_info->data_block_number);
+    if (!test_and_set_bit(ASSOOFS_SB_DIRTY, &sbi->s_flags))
+        queue_delayed_work(system_long_wq, &sbi->s_commit_work, ASSOOFS_COMMIT_INTERVAL * HZ);
+}
 
-    assoofs_add_inode_info(sb, inode_info);
+/*
+ * Numero maximo de inodos del volumen: inodes_per_group por grupo.
+ */
+static uint64_t assoofs_inodes_max(struct super_block *sb){
+    struct assoofs_super_block_info *assoofs_sb = ASSOOFS_SB(sb)->s_asb;
 
-    parent_inode_info = dir->i_private;
-    bh = sb_bread(sb, parent_inode_info->data_block_number);
+    return assoofs_sb->groups_count * assoofs_sb->inodes_per_group;
+}
 
-    dir_contents = (struct assoofs_dir_record_entry *)bh->b_data;
-    dir_contents += parent_inode_info->dir_children_count;
-    dir_contents->inode_no = inode_info->inode_no; // inode_info es la informacion persistente del inodo creado en el paso 2.
+/*
+ * Grupo para un directorio nuevo (Orlov simplificado). Las medias salen de los
+ * contadores globales, sin leer los descriptores de todos los grupos. Los que
+ * cuelgan de la raiz se reparten: empezando en un grupo al azar, se elige el
+ * primero con inodos y bloques libres por encima de la media y no mas
+ * directorios que la media. Los demas se quedan cerca de su padre salvo que su
+ * grupo este ya muy cargado. Devuelve -1 si ningun grupo cumple.
+ */
+static int64_t assoofs_find_group_dir(struct super_block *sb, struct inode *parent){
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    struct assoofs_super_block_info *assoofs_sb = sbi->s_asb;
+    uint64_t ngroups = assoofs_sb->groups_count, parent_group = assoofs_inode_group(sb, parent->i_ino);
+    int64_t avefreei, avefreeb, avedirs, max_dirs, min_inodes, min_blocks;
+    struct assoofs_group_info *group;
+    uint64_t i, g, start;
+
+    avefreei = percpu_counter_read_positive(&sbi->s_freeinodes_counter) / ngroups;
+    avefreeb = percpu_counter_read_positive(&sbi->s_freeblocks_counter) / ngroups;
+    avedirs = percpu_counter_read_positive(&sbi->s_dirs_counter) / ngroups;
+
+    if (parent->i_ino == ASSOOFS_ROOTDIR_INODE_NUMBER) {
+        start = prandom_u32_max(ngroups);
+        for (i = 0; i < ngroups; i++) {
+            g = (start + i) % ngroups;
+            group = assoofs_group(sb, g);
+            if (atomic_read(&group->dirs) <= avedirs && atomic_read(&group->free_inodes) >= avefreei &&
+                atomic_read(&group->free_blocks) >= avefreeb)
+                return g;
+        }
+    }
 
-    strcpy(dir_contents->filename, dentry->d_name.name);
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
-    brelse(bh);
+    // Como ext2: un grupo no admite mas directorios si ya tiene bastantes mas que la media
+    max_dirs = avedirs + assoofs_sb->inodes_per_group / 16;
+    min_inodes = max_t(int64_t, avefreei - assoofs_sb->inodes_per_group / 4, 1);
+    min_blocks = max_t(int64_t, avefreeb - assoofs_sb->blocks_per_group / 4, 1);
+    for (i = 0; i < ngroups; i++) {
+        g = (parent_group + i) % ngroups;
+        group = assoofs_group(sb, g);
+        if (atomic_read(&group->dirs) < max_dirs && atomic_read(&group->free_inodes) >= min_inodes &&
+            atomic_read(&group->free_blocks) >= min_blocks)
+            return g;
+    }
+    return -1;
+}
 
-    mutex_lock_interruptible(&assoofs_inodes_mgmt_lock);
+/*
+ * Grupo para un fichero nuevo: el de su directorio si le quedan inodos y
+ * bloques, para que los ficheros de un directorio esten juntos. Si no, como
+ * ext2, se prueba en saltos de potencias de dos para no llenar siempre el
+ * siguiente. Devuelve -1 si ningun grupo tiene inodos y bloques libres.
+ */
+static int64_t assoofs_find_group_other(struct super_block *sb, struct inode *parent){
+    uint64_t ngroups = ASSOOFS_SB(sb)->s_asb->groups_count, g = assoofs_inode_group(sb, parent->i_ino), i;
+    struct assoofs_group_info *group;
+
+    for (i = 0; i < ngroups; i = i ? i << 1 : 1) {
+        group = assoofs_group(sb, (g + i) % ngroups);
+        if (atomic_read(&group->free_inodes) > 0 && atomic_read(&group->free_blocks) > 0)
+            return (g + i) % ngroups;
+    }
+    return -1;
+}
 
-    parent_inode_info->dir_children_count++;
-    assoofs_save_inode_info(sb, parent_inode_info);
+/*
+ * Reserva en el mapa de inodos del grupo group una racha de hasta max numeros
+ * libres consecutivos: el primero en *inode_no y cuantos en *count. Devuelve
+ * -ENOSPC si el grupo esta lleno. Con reserve la racha solo se aparta para un
+ * lote, como en assoofs_find_freeblocks. El handle del llamante cuenta con un
+ * credito para el mapa.
+ */
+static int assoofs_take_inodes(struct super_block *sb, uint64_t group, bool reserve, uint32_t max, uint64_t *inode_no, uint32_t *count){
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    struct assoofs_super_block_info *assoofs_sb = sbi->s_asb;
+    struct buffer_head *bh;
+    unsigned long bit, end, j, *reserved;
+    int ret;
+
+    if (atomic_read(&assoofs_group(sb, group)->free_inodes) <= 0)
+        return -ENOSPC;
+    if (reserve && (ret = assoofs_alloc_reserved_map(sb, group)))
+        return ret;
+
+    assoofs_stat_inc(sb, ASSOOFS_STAT_META_READS);
+    bh = assoofs_bread_ahead(sb, assoofs_sb->inode_bitmap_block + group, assoofs_sb->inode_bitmap_block + assoofs_sb->inode_bitmap_blocks);
+    if (!bh)
+        return -EIO;
+    ret = assoofs_journal_get_write_access(sb, bh);
+    if (ret) {
+        brelse(bh);
+        return ret;
+    }
 
-    mutex_unlock(&assoofs_inodes_mgmt_lock);
+    assoofs_spin_lock(sb, bgl_lock_ptr(&sbi->s_bgl, group));
+    reserved = assoofs_reserved_map(sb, group, true);
+    bit = assoofs_find_free_run(bh, reserved, assoofs_sb->inodes_per_group, 0, max, &end);
+    if (bit >= assoofs_sb->inodes_per_group) {
+        spin_unlock(bgl_lock_ptr(&sbi->s_bgl, group));
+        brelse(bh);
+        return -ENOSPC;
+    }
+    *inode_no = group * assoofs_sb->inodes_per_group + bit + ASSOOFS_ROOTDIR_INODE_NUMBER;
+    *count = end - bit;
+    if (reserve) {
+        bitmap_set(reserved, bit, end - bit);
+        spin_unlock(bgl_lock_ptr(&sbi->s_bgl, group));
+        brelse(bh);
+        return 0;
+    }
+    for (j = bit; j < end; j++)
+        __set_bit_le(j, bh->b_data);
+    spin_unlock(bgl_lock_ptr(&sbi->s_bgl, group));
+    ret = assoofs_journal_dirty_metadata(sb, NULL, bh);
+    brelse(bh);
+    if (ret)
+        return ret;
 
+    percpu_counter_sub(&sbi->s_freeinodes_counter, *count);
+    atomic_sub(*count, &assoofs_group(sb, group)->free_inodes);
+    assoofs_mark_sb_dirty(sb);
     return 0;
 }
 
+/*
+ * Saca un numero de inodo del grupo group del lote de esta CPU, rellenandolo
+ * si esta vacio. Un lote de otro grupo se deja como esta (y se devuelve
+ * false): deshacerlo costaria tanto como reservar por la via normal.
+ */
+static bool assoofs_pool_get_inode(struct super_block *sb, uint64_t group, uint64_t *inode_no){
+    struct assoofs_pool *pool = raw_cpu_ptr(ASSOOFS_SB(sb)->s_pools);
+    uint64_t per_group = ASSOOFS_SB(sb)->s_asb->inodes_per_group;
+    uint64_t index;
+    uint32_t count;
+    bool got = false;
+
+    mutex_lock(&pool->lock);
+    if (!pool->inodes && !assoofs_take_inodes(sb, group, true, ASSOOFS_POOL_INODES, &pool->inode_no, &count))
+        pool->inodes = count;
+    if (pool->inodes && assoofs_inode_group(sb, pool->inode_no) == group) {
+        index = pool->inode_no - ASSOOFS_ROOTDIR_INODE_NUMBER;
+        count = 1;
+        if (!assoofs_claim(sb, group, true, index % per_group, &count)) {
+            *inode_no = pool->inode_no++;
+            pool->inodes--;
+            got = true;
+        } else {
+            assoofs_unreserve(sb, group, true, index % per_group, pool->inodes);
+            pool->inodes = 0;
+        }
+    }
+    mutex_unlock(&pool->lock);
+    return got;
+}
 
+/*
+ * Reserva un numero de inodo libre para un inodo nuevo de dir con modo mode.
+ * Se elige primero el grupo (assoofs_find_group_dir o _other) y, si su mapa
+ * de inodos resulta estar lleno, se siguen los demas en orden. Los ficheros
+ * salen del lote de la CPU cuando es del grupo elegido. El handle del
+ * llamante cuenta con un credito para el mapa.
+ */
+static int assoofs_new_inode_no(struct inode *dir, umode_t mode, uint64_t *inode_no){
+    struct super_block *sb = dir->i_sb;
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    uint64_t ngroups = sbi->s_asb->groups_count, scanned;
+    int64_t start;
+    uint32_t count;
+    bool drained = false;
+    int ret;
+
+    start = S_ISDIR(mode) ? assoofs_find_group_dir(sb, dir) : -1;
+    if (start < 0)
+        start = assoofs_find_group_other(sb, dir);
+    if (start >= 0 && !S_ISDIR(mode) && assoofs_pool_get_inode(sb, start, inode_no))
+        return 0;
 
-int assoofs_sb_get_a_freeblock(struct super_block *sb, uint64_t *block){
-    struct assoofs_super_block_info *assoofs_sb = sb->s_fs_info;
-    int i;
-    if(mutex_lock_interruptible(&assoofs_sb_lock)){
-        return -1;
+    if (!percpu_counter_read_positive(&sbi->s_freeinodes_counter) &&
+        !percpu_counter_sum_positive(&sbi->s_freeinodes_counter))
+        return -ENOSPC;
+    if (start < 0)
+        start = assoofs_inode_group(sb, dir->i_ino);
+
+retry:
+    for (scanned = 0; scanned < ngroups; scanned++) {
+        ret = assoofs_take_inodes(sb, (start + scanned) % ngroups, false, 1, inode_no, &count);
+        if (ret == -ENOSPC)
+            continue;
+        if (!ret && S_ISDIR(mode)) {
+            atomic_inc(&assoofs_group(sb, (start + scanned) % ngroups)->dirs);
+            percpu_counter_inc(&sbi->s_dirs_counter);
+        }
+        return ret;
     }
-    for (i = 2; i < ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED; i++)
-        if (assoofs_sb->free_blocks & (1 << i))
-            break;
-
-    *block = i;
+    // Lo que queda libre puede estar todo apartado en los lotes
+    if (!drained && assoofs_drain_pools(sb)) {
+        drained = true;
+        goto retry;
+    }
+    return -ENOSPC;
+}
 
-    assoofs_sb->free_blocks &= ~(1 << i); //MARCAR EL BLOQUE A 0
-    assoofs_save_sb_info(sb);
-    mutex_unlock(&assoofs_sb_lock);
+// Devuelve inode_no al mapa de bits de su grupo, dentro del handle abierto
+static int assoofs_free_inode_no(struct super_block *sb, uint64_t inode_no, bool dir){
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    uint64_t index = inode_no - ASSOOFS_ROOTDIR_INODE_NUMBER, i = assoofs_inode_group(sb, inode_no);
+    struct assoofs_group_info *group;
+    struct buffer_head *bh;
+    bool was_set;
+    int ret;
+
+    if (inode_no <= ASSOOFS_LAST_RESERVED_INODE || index >= assoofs_inodes_max(sb))
+        return -EIO;
+    assoofs_stat_inc(sb, ASSOOFS_STAT_META_READS);
+    bh = sb_bread(sb, sbi->s_asb->inode_bitmap_block + i);
+    if (!bh)
+        return -EIO;
+    ret = assoofs_journal_get_write_access(sb, bh);
+    if (ret) {
+        brelse(bh);
+        return ret;
+    }
+    assoofs_spin_lock(sb, bgl_lock_ptr(&sbi->s_bgl, i));
+    was_set = __test_and_clear_bit_le(index % sbi->s_asb->inodes_per_group, bh->b_data);
+    spin_unlock(bgl_lock_ptr(&sbi->s_bgl, i));
+    if (!was_set) {
+        printk(KERN_ERR "Freeing inode %llu, which is already free", inode_no);
+        brelse(bh);
+        return -EIO;
+    }
+    ret = assoofs_journal_dirty_metadata(sb, NULL, bh);
+    brelse(bh);
+    if (ret)
+        return ret;
+
+    group = assoofs_group(sb, i);
+    percpu_counter_inc(&sbi->s_freeinodes_counter);
+    atomic_inc(&group->free_inodes);
+    if (dir) {
+        atomic_dec(&group->dirs);
+        percpu_counter_dec(&sbi->s_dirs_counter);
+    }
+    assoofs_mark_sb_dirty(sb);
     return 0;
+}
 
+/*
+ * Deshace los lotes de todas las CPUs: lo que tenian apartado vuelve a estar
+ * a disposicion de cualquiera. Solo cambia la memoria. Devuelve si habia algo
+ * apartado.
+ */
+static bool assoofs_drain_pools(struct super_block *sb){
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    uint64_t bits_per_block = sbi->s_asb->blocks_per_group, per_group = sbi->s_asb->inodes_per_group;
+    struct assoofs_pool *pool;
+    bool found = false;
+    uint64_t index;
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        pool = per_cpu_ptr(sbi->s_pools, cpu);
+        mutex_lock(&pool->lock);
+        if (pool->blocks) {
+            assoofs_unreserve(sb, pool->block / bits_per_block, false, pool->block % bits_per_block, pool->blocks);
+            pool->blocks = 0;
+            found = true;
+        }
+        if (pool->inodes) {
+            index = pool->inode_no - ASSOOFS_ROOTDIR_INODE_NUMBER;
+            assoofs_unreserve(sb, index / per_group, true, index % per_group, pool->inodes);
+            pool->inodes = 0;
+            found = true;
+        }
+        mutex_unlock(&pool->lock);
+    }
+    return found;
 }
 
-void assoofs_save_sb_info(struct super_block *vsb){
+/*
+ * Lee el bloque de la tabla de inodos en el que esta la entrada de inode_no y
+ * devuelve en *slot un puntero a ella. La posicion se calcula a partir del
+ * numero de inodo, sin recorrer la tabla.
+ */
+struct buffer_head *assoofs_inode_slot(struct super_block *sb, uint64_t inode_no, struct assoofs_inode_info **slot){
+    struct assoofs_super_block_info *assoofs_sb = ASSOOFS_SB(sb)->s_asb;
+    uint64_t per_block = sb->s_blocksize / sizeof(struct assoofs_inode_info);
+    uint64_t index = inode_no - ASSOOFS_ROOTDIR_INODE_NUMBER;
     struct buffer_head *bh;
-    struct assoofs_super_block *sb; // Informacion persistente del superbloque en memoria
-    
 
-    sb = vsb->s_fs_info;
-    bh = sb_bread(vsb, ASSOOFS_SUPERBLOCK_BLOCK_NUMBER);
-    bh->b_data = (char *)sb; // Sobreescribo los datos de disco con la informacion en memoria
+    if (inode_no < ASSOOFS_ROOTDIR_INODE_NUMBER || index >= assoofs_inodes_max(sb))
+        return NULL;
 
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
+    assoofs_stat_inc(sb, ASSOOFS_STAT_META_READS);
+    bh = assoofs_bread_ahead(sb, assoofs_sb->inode_table_block + index / per_block,
+                             assoofs_sb->inode_table_block + assoofs_sb->inode_table_blocks);
+    if (!bh)
+        return NULL;
 
-    brelse(bh);
-    
-    
+    *slot = (struct assoofs_inode_info *)bh->b_data + index % per_block;
+    return bh;
+}
 
+/*
+ * Copia el inodo en memoria a su entrada de la tabla de inodos. Los inodos que
+ * comparten bloque de la tabla se serializan con el cerrojo de ese buffer. Con
+ * diario la entrada entra en la transaccion del handle abierto, cuyo numero se
+ * guarda en i_sync_tid para fsync; sin diario el buffer queda sucio y, con
+ * sync, se escribe y se espera.
+ */
+static int assoofs_write_inode_slot(struct inode *inode, int sync){
+    struct super_block *sb = inode->i_sb;
+    struct assoofs_inode *ai = ASSOOFS_I(inode);
+    struct assoofs_inode_info *inode_pos;
+    struct buffer_head *bh;
+    int ret;
+
+    bh = assoofs_inode_slot(sb, inode->i_ino, &inode_pos);
+    if (!bh)
+        return -EIO;
+    ret = assoofs_journal_get_write_access(sb, bh);
+    if (ret)
+        goto out;
+
+    down_read(&ai->i_data_sem);
+    lock_buffer(bh);
+    if (S_ISREG(ai->info.mode))
+        ai->info.file_size = i_size_read(inode);
+    memcpy(inode_pos, &ai->info, sizeof(*inode_pos));
+    unlock_buffer(bh);
+    up_read(&ai->i_data_sem);
+
+    ret = assoofs_journal_dirty_metadata(sb, NULL, bh);
+    if (ret)
+        goto out;
+    if (ASSOOFS_SB(sb)->s_journal) {
+        WRITE_ONCE(ai->i_sync_tid, journal_current_handle()->h_transaction->t_tid);
+    } else if (sync) {
+        sync_dirty_buffer(bh);
+        if (buffer_req(bh) && !buffer_uptodate(bh))
+            ret = -EIO;
+    }
+out:
+    brelse(bh);
+    return ret;
 }
 
-void assoofs_add_inode_info(struct super_block *sb, struct assoofs_inode_info *inode){
+/*
+ * Dice si la entrada de inode en la tabla ya tiene lo que
+ * assoofs_write_inode_slot copiaria en ella. Si no se puede leer dice que no:
+ * el error lo vera la escritura.
+ */
+static bool assoofs_inode_slot_current(struct inode *inode){
+    struct assoofs_inode *ai = ASSOOFS_I(inode);
+    struct assoofs_inode_info *inode_pos;
     struct buffer_head *bh;
-    struct assoofs_inode_info *inode_info;
-    struct assoofs_super_block_info *assoofs_sb;
+    uint64_t size;
+    bool same;
+
+    bh = assoofs_inode_slot(inode->i_sb, inode->i_ino, &inode_pos);
+    if (!bh)
+        return false;
+    down_read(&ai->i_data_sem);
+    lock_buffer(bh);
+    size = S_ISREG(ai->info.mode) ? i_size_read(inode) : ai->info.file_size;
+    same = inode_pos->file_size == size &&
+        !memcmp(inode_pos, &ai->info, offsetof(struct assoofs_inode_info, file_size)) &&
+        !memcmp(&inode_pos->flags, &ai->info.flags, sizeof(*inode_pos) - offsetof(struct assoofs_inode_info, flags));
+    unlock_buffer(bh);
+    up_read(&ai->i_data_sem);
+    brelse(bh);
+    return same;
+}
 
+/*
+ *  Operaciones sobre el superbloque
+ */
+
+/*
+* PARTE OPCIONAL CACHE DE INODOS
+*/
+static struct inode *assoofs_alloc_inode(struct super_block *sb) {
+    struct assoofs_inode *ai = kmem_cache_alloc(assoofs_inode_cache, GFP_KERNEL);
+
+    if (!ai)
+        return NULL;
+    memset(&ai->info, 0, sizeof(ai->info));
+    RCU_INIT_POINTER(ai->i_dcache, NULL);
+    return &ai->vfs_inode;
+}
 
-    assoofs_sb = (struct assoofs_super_block_info *)sb->s_fs_info;
+// Lo que sobrevive entre usos del objeto en el slab se inicializa una sola vez
+static void assoofs_inode_init_once(void *foo) {
+    struct assoofs_inode *ai = foo;
+
+    init_rwsem(&ai->i_data_sem);
+    spin_lock_init(&ai->i_dcache_lock);
+    inode_init_once(&ai->vfs_inode);
+}
 
-    if(mutex_lock_interruptible(&assoofs_inodes_mgmt_lock)){
-        return ;
+// Pone a cero la entrada de inode_no en la tabla de inodos
+static int assoofs_clear_inode_slot(struct super_block *sb, uint64_t inode_no) {
+    struct assoofs_inode_info *inode_pos;
+    struct buffer_head *bh;
+    int ret;
+
+    bh = assoofs_inode_slot(sb, inode_no, &inode_pos);
+    if (!bh)
+        return -EIO;
+    ret = assoofs_journal_get_write_access(sb, bh);
+    if (!ret) {
+        lock_buffer(bh);
+        memset(inode_pos, 0, sizeof(*inode_pos));
+        unlock_buffer(bh);
+        ret = assoofs_journal_dirty_metadata(sb, NULL, bh);
     }
-    bh = sb_bread(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER);
-    
-       
-    inode_info = (struct assoofs_inode_info *)bh->b_data;
+    brelse(bh);
+    return ret;
+}
 
-    if(mutex_lock_interruptible(&assoofs_sb_lock)){
-        return ;
+/*
+ * Borra del disco un inodo sin enlaces cuando se suelta la ultima referencia.
+ * Primero se vacia su entrada y se libera el numero y despues se devuelven sus
+ * bloques: si el handle se reinicia entre medias, una caida solo pierde
+ * bloques, nunca deja un inodo apuntando a bloques libres.
+ */
+static void assoofs_delete_inode(struct inode *inode) {
+    struct super_block *sb = inode->i_sb;
+    struct assoofs_inode_info *inode_info = &ASSOOFS_I(inode)->info;
+    struct assoofs_extent *list = NULL;
+    uint32_t count = 0;
+    uint64_t extent_block = 0;
+    handle_t *handle;
+    int ret, err;
+
+    sb_start_intwrite(sb);
+    handle = assoofs_journal_start(sb, ASSOOFS_DELETE_CREDITS);
+    if (IS_ERR(handle)) {
+        ret = PTR_ERR(handle);
+        goto out;
     }
 
-    inode_info += assoofs_sb->inodes_count;
+    if (!assoofs_has_inline_data(inode) && inode_info->extents_count) {
+        list = kmalloc_array(assoofs_max_extents(sb), sizeof(*list), GFP_NOFS);
+        ret = list ? assoofs_read_extents(sb, inode_info, list) : -ENOMEM;
+        if (ret)
+            goto out_stop;
+        count = inode_info->extents_count;
+        if (count > ASSOOFS_INODE_EXTENTS)
+            extent_block = inode_info->extent_block;
+    }
 
-    memcpy(inode_info, inode, sizeof(struct assoofs_inode_info));
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
+    ret = assoofs_clear_inode_slot(sb, inode->i_ino);
+    if (!ret)
+        ret = assoofs_free_inode_no(sb, inode->i_ino, S_ISDIR(inode->i_mode));
+    if (!ret)
+        ret = assoofs_release_blocks(inode, list, count, S_ISDIR(inode->i_mode));
+    if (!ret && extent_block) {
+        ret = assoofs_journal_forget(sb, extent_block);
+        if (!ret)
+            ret = assoofs_sb_free_blocks(sb, extent_block, 1);
+    }
+out_stop:
+    kfree(list);
+    err = assoofs_journal_stop(handle);
+    if (!ret)
+        ret = err;
+out:
+    if (ret)
+        printk(KERN_ERR "Unable to delete inode %lu: %d", inode->i_ino, ret);
+    sb_end_intwrite(sb);
+}
 
-    assoofs_sb->inodes_count++;
-    assoofs_save_sb_info(sb);
+/*
+ * Los bloques de directorio y de extensiones se asocian al inodo con
+ * mark_buffer_dirty_inode; hay que soltar esa lista antes de que la VFS
+ * libere un inodo que ya no esta en la cache. Un inodo sin enlaces se borra
+ * aqui, cuando ya nadie lo tiene abierto.
+ */
+static void assoofs_evict_inode(struct inode *inode) {
+    if (S_ISDIR(inode->i_mode))
+        assoofs_dcache_drop(inode);
+    truncate_inode_pages_final(&inode->i_data);
+    if (!inode->i_nlink && !is_bad_inode(inode))
+        assoofs_delete_inode(inode);
+    invalidate_inode_buffers(inode);
+    clear_inode(inode);
+}
 
-    mutex_unlock(&assoofs_sb_lock);
-    mutex_unlock(&assoofs_inodes_mgmt_lock);
+static void assoofs_free_inode(struct inode *inode) {
+    kmem_cache_free(assoofs_inode_cache, ASSOOFS_I(inode));
+}
 
-    brelse(bh);
+/*
+ * Sin diario, las modificaciones solo marcan el inodo como sucio
+ * (mark_inode_dirty) y es la writeback quien copia aqui la entrada; solo se
+ * espera a la escritura si la pide fsync o sync (WB_SYNC_ALL). Con diario la
+ * entrada ya esta en una transaccion (assoofs_dirty_inode) y aqui solo se
+ * espera a que se confirme; sync(2) lo hace de una vez en sync_fs.
+ */
+static int assoofs_write_inode(struct inode *inode, struct writeback_control *wbc) {
+    journal_t *journal = ASSOOFS_SB(inode->i_sb)->s_journal;
 
+    trace_assoofs_write_inode(inode, wbc->sync_mode == WB_SYNC_ALL);
+    if (!journal)
+        return assoofs_write_inode_slot(inode, wbc->sync_mode == WB_SYNC_ALL);
+    if (wbc->sync_mode != WB_SYNC_ALL || wbc->for_sync)
+        return 0;
+    return jbd2_complete_transaction(journal, READ_ONCE(ASSOOFS_I(inode)->i_sync_tid));
 }
 
-int assoofs_save_inode_info(struct super_block *sb, struct assoofs_inode_info *inode_info){
-    struct buffer_head *bh;
-    struct assoofs_inode_info *inode_pos;
-
-    bh = sb_bread(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER);
-    if(mutex_lock_interruptible(&assoofs_sb_lock)){
-        return -1;
+/*
+ * Con diario, cada mark_inode_dirty copia el inodo a su entrada dentro de la
+ * transaccion en curso, como ext4: la entrada del disco nunca queda por detras
+ * de un bloque de metadatos ya confirmado que dependa de ella.
+ */
+static void assoofs_dirty_inode(struct inode *inode, int flags) {
+    handle_t *handle;
+
+    if (!ASSOOFS_SB(inode->i_sb)->s_journal || flags == I_DIRTY_TIME)
+        return;
+    // Las fechas no se guardan: sin lazytime tocarlas llega como I_DIRTY_SYNC y no cambia la entrada
+    if (assoofs_inode_slot_current(inode)) {
+        // El handle abierto puede haber tocado otros metadatos del inodo (bloque de extensiones, mapa): fsync espera a esta transaccion
+        handle = journal_current_handle();
+        if (handle)
+            WRITE_ONCE(ASSOOFS_I(inode)->i_sync_tid, handle->h_transaction->t_tid);
+        return;
     }
-    inode_pos = assoofs_search_inode_info(sb, (struct assoofs_inode_info *)bh->b_data, inode_info);
+    handle = assoofs_journal_start(inode->i_sb, 1);
+    if (IS_ERR(handle))
+        return;
+    assoofs_write_inode_slot(inode, 0);
+    assoofs_journal_stop(handle);
+}
 
-    memcpy(inode_pos, inode_info, sizeof(*inode_pos));
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
-    brelse(bh);
+/*
+ * sync(2), syncfs(2) y desmontaje: el superbloque es el unico bloque que no
+ * pertenece a ningun inodo, asi que se escribe aqui. El mapa de bits y la
+ * tabla de inodos los vacia despues sync_blockdev.
+ */
+static int assoofs_sync_fs(struct super_block *sb, int wait) {
+    return assoofs_commit_super(sb, wait);
+}
 
-    mutex_unlock(&assoofs_sb_lock);
+/*
+ * df(1): los contadores se leen sin sumar las CPUs, asi que el coste es
+ * constante y no compite con las reservas. El valor puede desviarse en lo que
+ * cada CPU lleve acumulado sin volcar.
+ */
+static int assoofs_statfs(struct dentry *dentry, struct kstatfs *buf) {
+    struct super_block *sb = dentry->d_sb;
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    u64 id = huge_encode_dev(sb->s_bdev->bd_dev);
+
+    buf->f_type = ASSOOFS_MAGIC;
+    buf->f_bsize = sb->s_blocksize;
+    buf->f_blocks = sbi->s_asb->blocks_count;
+    buf->f_bfree = percpu_counter_read_positive(&sbi->s_freeblocks_counter);
+    buf->f_bavail = buf->f_bfree;
+    buf->f_files = assoofs_inodes_max(sb);
+    buf->f_ffree = percpu_counter_read_positive(&sbi->s_freeinodes_counter);
+    buf->f_namelen = ASSOOFS_FILENAME_MAXLEN;
+    buf->f_fsid = u64_to_fsid(id);
     return 0;
 }
 
-struct assoofs_inode_info *assoofs_search_inode_info(struct super_block *sb, struct assoofs_inode_info *start, struct assoofs_inode_info *search){
-    uint64_t count = 0;
-    while (start->inode_no != search->inode_no && count < ((struct assoofs_super_block_info *)sb->s_fs_info)->inodes_count) {
-        count++;
-        start++;
+static int assoofs_stats_show(struct seq_file *m, void *v) {
+    struct assoofs_sb_info *sbi = m->private;
+    struct assoofs_stats *stats;
+    u64 sum;
+    int i, b, cpu;
+
+    for (i = 0; i < ASSOOFS_STAT_NR; i++) {
+        sum = 0;
+        for_each_possible_cpu(cpu)
+            sum += per_cpu_ptr(sbi->s_stats, cpu)->count[i];
+        seq_printf(m, "%s %llu\n", assoofs_stat_names[i], sum);
     }
 
-    if (start->inode_no == search->inode_no)
-        return start;
-    else
-        return NULL;
+    for (i = 0; i < ASSOOFS_HIST_NR; i++) {
+        seq_printf(m, "\n%s latency (ns):\n", assoofs_hist_names[i]);
+        for (b = 0; b < ASSOOFS_HIST_BUCKETS; b++) {
+            sum = 0;
+            for_each_possible_cpu(cpu) {
+                stats = per_cpu_ptr(sbi->s_stats, cpu);
+                sum += stats->hist[i][b];
+            }
+            if (sum)
+                seq_printf(m, "  [%llu, %llu) %llu\n", b ? 1ULL << b : 0, 1ULL << (b + 1), sum);
+        }
+    }
+    return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(assoofs_stats);
 
+static void assoofs_debugfs_init(struct super_block *sb) {
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+
+    // debugfs es opcional: si falla el volumen funciona igual, sin estadisticas visibles
+    sbi->s_debugfs = debugfs_create_dir(sb->s_id, assoofs_debugfs_root);
+    debugfs_create_file("stats", 0444, sbi->s_debugfs, sbi, &assoofs_stats_fops);
+}
+
+static void assoofs_put_groups(struct super_block *sb);
+
+static void assoofs_put_super(struct super_block *sb) {
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+
+    assoofs_commit_super(sb, 1);
+    cancel_delayed_work_sync(&sbi->s_commit_work);
+    if (sbi->s_journal)
+        jbd2_journal_destroy(sbi->s_journal); // Confirma lo pendiente y lleva cada bloque a su sitio
+    debugfs_remove_recursive(sbi->s_debugfs);
+    // Los directorios ya se han expulsado y, con ellos, sus caches de nombres
+    unregister_shrinker(&sbi->s_dcache_shrinker);
+    list_lru_destroy(&sbi->s_dcache_lru);
+    percpu_counter_destroy(&sbi->s_dirs_counter);
+    percpu_counter_destroy(&sbi->s_freeinodes_counter);
+    percpu_counter_destroy(&sbi->s_freeblocks_counter);
+    assoofs_put_groups(sb);
+    free_percpu(sbi->s_pools);
+    free_percpu(sbi->s_stats);
+    brelse(sbi->s_sbh);
+    sb->s_fs_info = NULL;
+    kfree(sbi);
+}
+
+static const struct super_operations assoofs_sops = {
+    .alloc_inode    = assoofs_alloc_inode,
+    .free_inode     = assoofs_free_inode,
+    .evict_inode    = assoofs_evict_inode,
+    .dirty_inode    = assoofs_dirty_inode,
+    .write_inode    = assoofs_write_inode,
+    .sync_fs        = assoofs_sync_fs,
+    .put_super      = assoofs_put_super,
+    .statfs         = assoofs_statfs,
+};
 
 /*
- *  Operaciones sobre el superbloque
+ * Abre el diario del volumen y repite las transacciones confirmadas que no
+ * llegaron a escribirse en su sitio. Se hace antes de leer cualquier otro
+ * metadato; el inodo del diario no lo modifica ninguna transaccion, asi que se
+ * puede leer antes de la repeticion.
  */
+static int assoofs_load_journal(struct super_block *sb) {
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    struct inode *journal_inode;
+    journal_t *journal;
+    int ret;
+
+    journal_inode = assoofs_iget(sb, sbi->s_asb->journal_inode);
+    if (IS_ERR(journal_inode)) {
+        printk(KERN_ERR "Unable to read the journal inode");
+        return PTR_ERR(journal_inode);
+    }
+    if (!S_ISREG(journal_inode->i_mode) || assoofs_has_inline_data(journal_inode)) {
+        printk(KERN_ERR "Invalid journal inode");
+        iput(journal_inode);
+        return -EINVAL;
+    }
+
+    journal = jbd2_journal_init_inode(journal_inode);
+    if (!journal) {
+        printk(KERN_ERR "Unable to initialize the journal");
+        iput(journal_inode);
+        return -EINVAL;
+    }
+    journal->j_private = sb;
+    journal->j_commit_interval = ASSOOFS_COMMIT_INTERVAL * HZ;
+    journal->j_flags |= JBD2_BARRIER;
+
+    ret = jbd2_journal_load(journal);
+    if (ret) {
+        printk(KERN_ERR "Unable to load the journal");
+        jbd2_journal_destroy(journal); // Tambien suelta journal_inode
+        return ret;
+    }
+    sbi->s_journal = journal;
+    return 0;
+}
 
 /*
-* PARTE OPCIONAL CACHE DE INODOS
-*/
-void assoofs_destroy_inode(struct inode *inode) {
-    struct assoofs_inode *inode_info = inode->i_private;
-    printk(KERN_INFO "Freeing private data of inode %p ( %lu)\n", inode_info, inode->i_ino);
-    kmem_cache_free(assoofs_inode_cache, inode_info);
+ * Comprueba que la geometria de los grupos cuadra con el tamano del volumen:
+ * un bloque de cada mapa de bits por grupo y sitio en la tabla de inodos para
+ * todos los de cada grupo.
+ */
+static bool assoofs_valid_groups(struct super_block *sb, struct assoofs_super_block_info *assoofs_sb) {
+    uint64_t bits = sb->s_blocksize * 8, groups = assoofs_sb->groups_count;
+
+    return assoofs_sb->blocks_per_group == bits &&
+        assoofs_sb->inodes_per_group && assoofs_sb->inodes_per_group <= bits &&
+        groups == DIV_ROUND_UP(assoofs_sb->blocks_count, bits) &&
+        assoofs_sb->bitmap_blocks == groups && assoofs_sb->inode_bitmap_blocks == groups &&
+        assoofs_sb->inode_table_blocks * (sb->s_blocksize / sizeof(struct assoofs_inode_info)) >= groups * assoofs_sb->inodes_per_group &&
+        assoofs_sb->group_desc_blocks == DIV_ROUND_UP(groups * sizeof(struct assoofs_group_desc), sb->s_blocksize);
 }
 
-static const struct super_operations assoofs_sops = {
-    .destroy_inode  = assoofs_destroy_inode,
-};
+static void assoofs_put_groups(struct super_block *sb) {
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    uint64_t i;
+
+    for (i = 0; sbi->s_group_desc && i < sbi->s_asb->group_desc_blocks; i++)
+        if (!IS_ERR(sbi->s_group_desc[i]))
+            brelse(sbi->s_group_desc[i]);
+    for (i = 0; sbi->s_groups && i < sbi->s_asb->groups_count; i++)
+        kfree(sbi->s_groups[i].reserved);
+    kvfree(sbi->s_group_desc);
+    kvfree(sbi->s_groups);
+    sbi->s_group_desc = NULL;
+    sbi->s_groups = NULL;
+}
+
+/*
+ * Reserva los contadores de los grupos y la tabla de punteros a los bloques de
+ * descriptores. Al montar no se lee ningun descriptor: cada bloque se carga la
+ * primera vez que se usa uno de sus grupos (assoofs_load_group_desc).
+ */
+static int assoofs_load_groups(struct super_block *sb) {
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    struct assoofs_super_block_info *assoofs_sb = sbi->s_asb;
+
+    sbi->s_groups = kvcalloc(assoofs_sb->groups_count, sizeof(*sbi->s_groups), GFP_KERNEL);
+    sbi->s_group_desc = kvcalloc(assoofs_sb->group_desc_blocks, sizeof(*sbi->s_group_desc), GFP_KERNEL);
+    if (!sbi->s_groups || !sbi->s_group_desc) {
+        assoofs_put_groups(sb);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+/*
+ * Lee el bloque de descriptores que contiene group, que queda fijo en memoria
+ * como el superbloque, y carga los contadores de todos sus grupos. Si la
+ * lectura falla esos grupos se quedan a cero, como llenos, hasta el proximo
+ * montaje.
+ */
+static struct assoofs_group_info *assoofs_load_group_desc(struct super_block *sb, uint64_t group) {
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    struct assoofs_super_block_info *assoofs_sb = sbi->s_asb;
+    uint64_t per_block = sb->s_blocksize / sizeof(struct assoofs_group_desc);
+    uint64_t index = group / per_block, g;
+    struct assoofs_group_desc *desc;
+    struct assoofs_group_info *gi;
+    struct buffer_head *bh;
+
+    mutex_lock(&sbi->s_group_lock);
+    if (sbi->s_group_desc[index]) // Lo ha cargado otra tarea mientras se esperaba
+        goto out;
+
+    assoofs_stat_inc(sb, ASSOOFS_STAT_META_READS);
+    bh = assoofs_bread_ahead(sb, assoofs_sb->group_desc_block + index,
+                             assoofs_sb->group_desc_block + assoofs_sb->group_desc_blocks);
+    if (!bh) {
+        printk(KERN_ERR "Unable to read group descriptor block %llu, its groups are not used", index);
+        smp_store_release(&sbi->s_group_desc[index], ERR_PTR(-EIO));
+        goto out;
+    }
+    desc = (struct assoofs_group_desc *)bh->b_data;
+    for (g = index * per_block; g < assoofs_sb->groups_count && g < (index + 1) * per_block; g++, desc++) {
+        gi = &sbi->s_groups[g];
+        atomic_set(&gi->free_blocks, desc->free_blocks_count);
+        atomic_set(&gi->free_inodes, desc->free_inodes_count);
+        atomic_set(&gi->dirs, desc->dirs_count);
+    }
+    smp_store_release(&sbi->s_group_desc[index], bh); // Quien vea el buffer ve ya los contadores
+out:
+    mutex_unlock(&sbi->s_group_lock);
+    return &sbi->s_groups[group];
+}
 
 /*
  *  Inicialización del superbloque
@@ -501,96 +4136,196 @@ int assoofs_fill_super(struct super_block *sb, void *data, int silent) {
     struct inode *root_inode;
     struct buffer_head *bh;
     struct assoofs_super_block_info *assoofs_sb;
-    printk(KERN_INFO "assoofs_fill_super request\n");
+    struct assoofs_sb_info *sbi;
+    uint64_t block_size, i, dirs = 0;
+    int cpu, ret;
 
-    // 1.- Leer la información persistente del superbloque del dispositivo de bloques
+    // 1.- Leer la información persistente del superbloque del dispositivo de bloques.
+    //     Esta al principio del bloque 0, asi que se lee con el tamano minimo y, si el
+    //     volumen usa otro, se vuelve a leer con el suyo.
    
+    if (!sb_min_blocksize(sb, ASSOOFS_MIN_BLOCK_SIZE)) {
+        printk(KERN_ERR "Unable to set the minimum block size");
+        return -EINVAL;
+    }
     bh = sb_bread(sb, ASSOOFS_SUPERBLOCK_BLOCK_NUMBER); 
-    assoofs_sb = (struct assoofs_super_block_info *)bh->b_data; 
-
-    brelse(bh); //Liberar memoria
+    if (!bh)
+        return -EIO;
+    assoofs_sb = (struct assoofs_super_block_info *)bh->b_data; // El buffer se conserva hasta put_super
 
     // 2.- Comprobar los parámetros del superbloque
-    if(assoofs_sb->magic != ASSOOFS_MAGIC || assoofs_sb->block_size != ASSOOFS_DEFAULT_BLOCK_SIZE){
+    block_size = assoofs_sb->block_size;
+    if(assoofs_sb->magic != ASSOOFS_MAGIC || block_size < ASSOOFS_MIN_BLOCK_SIZE || block_size > ASSOOFS_MAX_BLOCK_SIZE || !is_power_of_2(block_size)){
         printk(KERN_ERR "Magic number or block size mismatch");
-        return -1;
+        brelse(bh);
+        return -EINVAL;
+    }
+
+    if (block_size != sb->s_blocksize) {
+        brelse(bh);
+        // sb_set_blocksize falla si es menor que el sector del dispositivo o mayor que PAGE_SIZE
+        if (!sb_set_blocksize(sb, block_size)) {
+            printk(KERN_ERR "Unsupported block size %llu", block_size);
+            return -EINVAL;
+        }
+        bh = sb_bread(sb, ASSOOFS_SUPERBLOCK_BLOCK_NUMBER);
+        if (!bh)
+            return -EIO;
+        assoofs_sb = (struct assoofs_super_block_info *)bh->b_data;
+        if (assoofs_sb->magic != ASSOOFS_MAGIC || assoofs_sb->block_size != block_size) {
+            printk(KERN_ERR "Magic number or block size mismatch");
+            brelse(bh);
+            return -EINVAL;
+        }
+    }
+
+    if (!assoofs_valid_groups(sb, assoofs_sb)) {
+        printk(KERN_ERR "Volume without block groups or with a bad group layout, recreate it with mkassoofs");
+        brelse(bh);
+        return -EINVAL;
+    }
+
+    sbi = kzalloc(sizeof(*sbi), GFP_KERNEL);
+    if (!sbi) {
+        brelse(bh);
+        return -ENOMEM;
     }
+    sbi->s_sbh = bh;
+    sbi->s_asb = assoofs_sb;
+    sbi->s_sb = sb;
+    bgl_lock_init(&sbi->s_bgl);
+    mutex_init(&sbi->s_group_lock);
+    INIT_DELAYED_WORK(&sbi->s_commit_work, assoofs_commit_work);
+    sb->s_fs_info = sbi; // assoofs_inodes_max lo necesita
+
+    ret = -ENOMEM;
+    sbi->s_stats = alloc_percpu(struct assoofs_stats);
+    if (!sbi->s_stats)
+        goto out_free_sbi;
+    sbi->s_pools = alloc_percpu(struct assoofs_pool); // Vacios: se llenan en la primera reserva
+    if (!sbi->s_pools)
+        goto out_free_stats;
+    for_each_possible_cpu(cpu)
+        mutex_init(&per_cpu_ptr(sbi->s_pools, cpu)->lock);
 
     // 3.- Escribir la información persistente leída del dispositivo de bloques en el superbloque sb, incluído el campo s_op con las operaciones que soporta.
     sb->s_magic = ASSOOFS_MAGIC;
-    printk(KERN_INFO "Magic number in the disk %ld\n",sb->s_magic);
-    sb->s_maxbytes = ASSOOFS_DEFAULT_BLOCK_SIZE;
+    sb->s_maxbytes = min_t(loff_t, MAX_LFS_FILESIZE, (loff_t)U32_MAX << sb->s_blocksize_bits); // Los bloques logicos de las extensiones son de 32 bits
     sb->s_op = &assoofs_sops;
-    sb->s_fs_info = assoofs_sb;
 
-    // 4.- Crear el inodo raíz y asignarle operaciones sobre inodos (i_op) y sobre directorios (i_fop)
+    if (assoofs_sb->journal_inode) {
+        ret = assoofs_load_journal(sb);
+        if (ret)
+            goto out_free_stats;
+    }
+
+    // Los contadores se leen despues de repetir el diario, que puede traer un superbloque mas reciente.
+    // De los grupos solo se reserva sitio: sus descriptores se leen al usarlos
+    ret = assoofs_load_groups(sb);
+    if (ret)
+        goto out_journal;
+    ret = -ENOMEM;
+    if (percpu_counter_init(&sbi->s_freeblocks_counter, assoofs_sb->free_blocks_count, GFP_KERNEL))
+        goto out_groups;
+    if (percpu_counter_init(&sbi->s_freeinodes_counter, assoofs_inodes_max(sb) - assoofs_sb->inodes_count, GFP_KERNEL))
+        goto out_free_blocks_counter;
+    // Un volumen anterior a dirs_count lo tiene a cero, cuando al menos esta la raiz: se suma una vez de los grupos
+    for (i = 0; !assoofs_sb->dirs_count && i < assoofs_sb->groups_count; i++)
+        dirs += atomic_read(&assoofs_group(sb, i)->dirs);
+    if (percpu_counter_init(&sbi->s_dirs_counter, assoofs_sb->dirs_count ? assoofs_sb->dirs_count : dirs, GFP_KERNEL))
+        goto out_free_inodes_counter;
+    if (list_lru_init(&sbi->s_dcache_lru))
+        goto out_free_dirs_counter;
+    sbi->s_dcache_shrinker.count_objects = assoofs_dcache_count;
+    sbi->s_dcache_shrinker.scan_objects = assoofs_dcache_scan;
+    sbi->s_dcache_shrinker.seeks = DEFAULT_SEEKS;
+    sbi->s_dcache_shrinker.flags = SHRINKER_NUMA_AWARE;
+    ret = register_shrinker(&sbi->s_dcache_shrinker);
+    if (ret)
+        goto out_free_lru;
+
+    // 4.- Crear el inodo raíz: se obtiene como cualquier otro, con i_op e i_fop de directorio segun su modo
     
-    root_inode = new_inode(sb);
-    inode_init_owner(root_inode, NULL, S_IFDIR);
-    root_inode->i_ino = ASSOOFS_ROOTDIR_INODE_NUMBER; // numero de inodo
-    root_inode->i_sb = sb; // puntero al superbloque
-    root_inode->i_op = &assoofs_inode_ops; // direccion de una variable de tipo struct inode_operations previamente declarada
-    root_inode->i_fop = &assoofs_dir_operations; // direccion de una variable de tipo struct file_operations previamente declarada.
-                                                //En la practica tenemos 2: assoofs_dir_operations y assoofs_file_operations. La primera la utilizaremos 
-                                                //cuando creemos inodos para directorios (como el directorio ra´ız) y la segunda cuando creemos inodos para ficheros.
-    root_inode->i_atime = root_inode->i_mtime = root_inode->i_ctime = current_time(root_inode); // fechas.
-    root_inode->i_private = assoofs_get_inode_info(sb, ASSOOFS_ROOTDIR_INODE_NUMBER); // Informacion persistente del inodo
+    root_inode = assoofs_iget(sb, ASSOOFS_ROOTDIR_INODE_NUMBER);
+    if (IS_ERR(root_inode)) {
+        ret = PTR_ERR(root_inode);
+        goto out_free;
+    }
 
     sb->s_root = d_make_root(root_inode); //Por ser el inodo raiz
+    if (!sb->s_root) {
+        ret = -ENOMEM;
+        goto out_free;
+    }
 
+    assoofs_debugfs_init(sb);
     return 0;
+
+out_free:
+    cancel_delayed_work_sync(&sbi->s_commit_work);
+    unregister_shrinker(&sbi->s_dcache_shrinker);
+out_free_lru:
+    list_lru_destroy(&sbi->s_dcache_lru);
+out_free_dirs_counter:
+    percpu_counter_destroy(&sbi->s_dirs_counter);
+out_free_inodes_counter:
+    percpu_counter_destroy(&sbi->s_freeinodes_counter);
+out_free_blocks_counter:
+    percpu_counter_destroy(&sbi->s_freeblocks_counter);
+out_groups:
+    assoofs_put_groups(sb);
+out_journal:
+    if (sbi->s_journal)
+        jbd2_journal_destroy(sbi->s_journal);
+out_free_stats:
+    free_percpu(sbi->s_pools);
+    free_percpu(sbi->s_stats);
+out_free_sbi:
+    sb->s_fs_info = NULL;
+    brelse(bh);
+    kfree(sbi);
+    return ret;
 }
 
 
 
 
-struct assoofs_inode_info *assoofs_get_inode_info(struct super_block *sb, uint64_t inode_no){
-    struct assoofs_inode_info *inode_info = NULL;
+/*
+ * Copia en inode_info la entrada inode_no de la tabla de inodos.
+ */
+int assoofs_get_inode_info(struct super_block *sb, uint64_t inode_no, struct assoofs_inode_info *inode_info){
+    struct assoofs_inode_info *inode_pos = NULL;
     struct buffer_head *bh;
-    struct assoofs_super_block_info *afs_sb = sb->s_fs_info;
-    struct assoofs_inode_info *buffer = NULL;
+    int ret = 0;
 
-    int i;
-    printk(KERN_INFO "assoofs_get_inode_info request");
-    bh = sb_bread(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER);
-    inode_info = (struct assoofs_inode_info *)bh->b_data;
+    bh = assoofs_inode_slot(sb, inode_no, &inode_pos);
+    if (!bh) {
+        printk(KERN_ERR "assoofs_get_inode_info: Inode not found");
+        trace_assoofs_read_inode(sb, inode_no, -EIO);
+        return -EIO;
+    }
 
-    mutex_lock_interruptible(&assoofs_inodes_mgmt_lock);
+    lock_buffer(bh);
     
-    for (i = 0; i < afs_sb->inodes_count; i++) {
-        if (inode_info->inode_no == inode_no) {
-            buffer = kmem_cache_alloc(assoofs_inode_cache, GFP_KERNEL);
-            memcpy(buffer, inode_info, sizeof(*buffer));
-            break;
-        }
-        inode_info++;
-    }
-    if(i >= afs_sb->inodes_count){
+    if (inode_pos->inode_no == inode_no) {
+        memcpy(inode_info, inode_pos, sizeof(*inode_info));
+    } else {
         printk(KERN_ERR "assoofs_get_inode_info: Inode not found");
+        ret = -EIO;
     }
+    unlock_buffer(bh);
     brelse(bh);
-    mutex_unlock(&assoofs_inodes_mgmt_lock);
-    printk(KERN_INFO "assoofs_get_inode_info finish");
-    return buffer;
+    trace_assoofs_read_inode(sb, inode_no, ret);
+    return ret;
 }
 
 
-
-
 /*
  *  Montaje de dispositivos assoofs
  */
 static struct dentry *assoofs_mount(struct file_system_type *fs_type, int flags, const char *dev_name, void *data) {
-    struct dentry *ret = mount_bdev(fs_type, flags, dev_name, data, assoofs_fill_super);
-     printk(KERN_INFO "assoofs_mount request\n");
-    // Control de errores a partir del valor de ret. En este caso se puede utilizar la macro IS_ERR: if (IS_ERR(ret)) ...
-    if (IS_ERR(ret)){
-        printk(KERN_ERR "Error in assoofs_mount ");
-        return NULL;
-    }else{
-         printk(KERN_INFO "assoofs_mount completed");
-         return ret;
-    }
+    // fill_super ya explica por que rechaza el volumen; el ERR_PTR llega tal cual a la VFS
+    return mount_bdev(fs_type, flags, dev_name, data, assoofs_fill_super);
 }
 
 /*
@@ -600,18 +4335,28 @@ static struct file_system_type assoofs_type = {
     .owner   = THIS_MODULE,
     .name    = "assoofs",
     .mount   = assoofs_mount,
-    .kill_sb = kill_litter_super,
+    .kill_sb = kill_block_super, // generic_shutdown_super hace sync_filesystem antes de soltar el dispositivo
 };
 
 static int __init assoofs_init(void) {
-    int ret = register_filesystem(&assoofs_type);
-    assoofs_inode_cache = kmem_cache_create("assoofs_inode_cache", sizeof(struct assoofs_inode_info), 0, (SLAB_RECLAIM_ACCOUNT|SLAB_MEM_SPREAD), NULL);
+    int ret;
+
+    BUILD_BUG_ON(sizeof(struct assoofs_inode_info) != ASSOOFS_INODE_SIZE);
+
+    // La cache tiene que existir antes de que nadie pueda montar
+    assoofs_inode_cache = kmem_cache_create("assoofs_inode_cache", sizeof(struct assoofs_inode), 0, (SLAB_RECLAIM_ACCOUNT|SLAB_MEM_SPREAD|SLAB_ACCOUNT), assoofs_inode_init_once);
+    if (!assoofs_inode_cache)
+        return -ENOMEM;
+    assoofs_debugfs_root = debugfs_create_dir("assoofs", NULL);
+    ret = register_filesystem(&assoofs_type);
 
     printk(KERN_INFO "assoofs_init request\n");
     // Control de errores a partir del valor de ret
     if(ret !=0){
         printk(KERN_INFO "Error initializing filesystem ");
-        return -1;
+        debugfs_remove_recursive(assoofs_debugfs_root);
+        kmem_cache_destroy(assoofs_inode_cache);
+        return ret;
     }
     printk(KERN_INFO "assoofs_init completed");
     return 0;
@@ -620,6 +4365,8 @@ static int __init assoofs_init(void) {
 static void __exit assoofs_exit(void) { 
     int ret = unregister_filesystem(&assoofs_type);
     printk(KERN_INFO "assoofs_exit request\n");
+    debugfs_remove_recursive(assoofs_debugfs_root);
+    rcu_barrier(); // free_inode y la liberacion de las caches de nombres esperan a un periodo de gracia RCU
     kmem_cache_destroy(assoofs_inode_cache);
     if(ret !=0){
         printk(KERN_INFO "Error in assoofs_exit ");
@@ -1,34 +1,153 @@
 #define ASSOOFS_MAGIC 0x20200406
 #define ASSOOFS_DEFAULT_BLOCK_SIZE 4096
+#define ASSOOFS_MIN_BLOCK_SIZE 1024    /* mkassoofs -b acepta potencias de dos en [MIN, MAX] */
+#define ASSOOFS_MAX_BLOCK_SIZE 65536
 #define ASSOOFS_FILENAME_MAXLEN 255
-#define ASSOOFS_LAST_RESERVED_BLOCK ASSOOFS_ROOTDIR_BLOCK_NUMBER
-#define ASSOOFS_LAST_RESERVED_INODE ASSOOFS_ROOTDIR_INODE_NUMBER
+#define ASSOOFS_LAST_RESERVED_INODE ASSOOFS_JOURNAL_INODE_NUMBER
+#define ASSOOFS_BLOCKS_PER_INODE 4  /* mkassoofs crea un inodo por cada 4 bloques del dispositivo */
 const int ASSOOFS_SUPERBLOCK_BLOCK_NUMBER = 0;
 const int ASSOOFS_INODESTORE_BLOCK_NUMBER = 1;
-const int ASSOOFS_ROOTDIR_BLOCK_NUMBER = 2;
 const int ASSOOFS_ROOTDIR_INODE_NUMBER = 1;
-const int ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED = 64;
+const int ASSOOFS_JOURNAL_INODE_NUMBER = 2;  /* fichero oculto con el diario jbd2, si lo hay */
+#define ASSOOFS_DEFAULT_JOURNAL_BLOCKS 2048
+#define ASSOOFS_MIN_JOURNAL_BLOCKS 1024      /* JBD2_MIN_JOURNAL_BLOCKS */
+#define ASSOOFS_INODE_SIZE 256     /* tamano de cada entrada de la tabla de inodos */
+#define ASSOOFS_INODE_HEADER 40    /* lo que precede a la union extents/inline_data */
+#define ASSOOFS_INLINE_DATA_MAX (ASSOOFS_INODE_SIZE - ASSOOFS_INODE_HEADER)
+#define ASSOOFS_INODE_EXTENTS (ASSOOFS_INLINE_DATA_MAX / 16)
+
+/* Flags del inodo */
+#define ASSOOFS_INODE_INLINE_DATA 0x1  /* los datos del fichero estan en inline_data, sin bloques */
 
 struct assoofs_super_block_info {
     uint64_t version;
     uint64_t magic;
     uint64_t block_size;    
-    uint64_t inodes_count;
-    uint64_t free_blocks;
-    char padding[4056];
+    uint64_t inodes_count;      /* inodos en uso, contando los reservados */
+    uint64_t inode_table_block;  /* primer bloque de la tabla de inodos */
+    uint64_t inode_table_blocks; /* el inodo n ocupa la entrada n - 1 de la tabla */
+    uint64_t blocks_count;      /* bloques totales del dispositivo */
+    uint64_t free_blocks_count;
+    uint64_t bitmap_block;      /* primer bloque del mapa de bits de bloques libres (1 = ocupado) */
+    uint64_t bitmap_blocks;     /* uno por grupo */
+    uint64_t journal_inode;     /* inodo del diario; 0 si el volumen se creo sin diario */
+    uint64_t inode_bitmap_block;  /* mapa de bits de inodos libres, un bloque por grupo */
+    uint64_t inode_bitmap_blocks;
+    uint64_t blocks_per_group;  /* block_size * 8: los bits de un bloque del mapa */
+    uint64_t inodes_per_group;  /* el grupo g tiene los inodos [g * inodes_per_group + 1, ...] */
+    uint64_t groups_count;
+    uint64_t group_desc_block;  /* tabla de descriptores de grupo */
+    uint64_t group_desc_blocks;
+    uint64_t dirs_count;        /* directorios: la suma de los dirs_count de los grupos */
+};  /* el resto del bloque 0 queda a cero, sea cual sea block_size */
+
+/*
+ * El volumen se divide en grupos de blocks_per_group bloques, cada uno con su
+ * bloque del mapa de bits, su bloque del mapa de inodos y su trozo de la tabla
+ * de inodos. Como en ext4 con flex_bg, los metadatos de todos los grupos estan
+ * juntos al principio del dispositivo. Los contadores del descriptor solo
+ * orientan la reserva; los mapas de bits son los que mandan.
+ */
+struct assoofs_group_desc {
+    uint32_t free_blocks_count;
+    uint32_t free_inodes_count;
+    uint32_t dirs_count;
+    uint32_t reserved;
 };
 
+/*
+ * Entrada de directorio de longitud variable. Las entradas de una hoja se
+ * encadenan con rec_len y la ultima llega hasta el final del bloque; una
+ * entrada con inode_no == 0 es hueco libre. El nombre no lleva '\0'.
+ */
 struct assoofs_dir_record_entry {
-    char filename[ASSOOFS_FILENAME_MAXLEN];
     uint64_t inode_no;
+    uint16_t rec_len;
+    uint8_t name_len;
+    uint8_t file_type;
+    char filename[];
+};
+
+#define ASSOOFS_DIR_REC_HEADER 12
+#define ASSOOFS_DIR_REC_LEN(name_len) ((ASSOOFS_DIR_REC_HEADER + (name_len) + 7) & ~7)
+
+/*
+ * rec_len es de 16 bits: una entrada que ocupa un bloque entero de 64 KiB se
+ * guarda como 0xffff. Como rec_len siempre es multiplo de 8 no hay ambiguedad.
+ */
+#define ASSOOFS_DIR_MAX_REC_LEN 0xffff
+
+static inline unsigned int assoofs_rec_len_from_disk(uint16_t dlen) {
+    return dlen == ASSOOFS_DIR_MAX_REC_LEN ? ASSOOFS_MAX_BLOCK_SIZE : dlen;
+}
+
+static inline uint16_t assoofs_rec_len_to_disk(unsigned int len) {
+    return len >= ASSOOFS_MAX_BLOCK_SIZE ? ASSOOFS_DIR_MAX_REC_LEN : len;
+}
+
+/* Tipos de fichero de las entradas de directorio: los mismos valores que FT_* del VFS */
+#define ASSOOFS_FT_UNKNOWN 0
+#define ASSOOFS_FT_REG_FILE 1
+#define ASSOOFS_FT_DIR 2
+
+/*
+ * Un directorio ocupa varios bloques. Su bloque logico 0 es un indice ordenado
+ * por hash del nombre: la entrada i lleva al bloque hoja con las entradas cuyo
+ * hash esta en [entries[i].hash, entries[i + 1].hash). entries[0].hash es 0.
+ * Cuando una hoja se llena se parte en dos por la mediana de los hashes.
+ */
+struct assoofs_dir_index_entry {
+    uint32_t hash;
+    uint32_t block;     /* bloque logico del directorio */
 };
 
+struct assoofs_dir_index {
+    uint32_t count;
+    uint32_t reserved;
+    struct assoofs_dir_index_entry entries[];
+};
+
+/* FNV-1a: estable en disco y comun al modulo y a mkassoofs */
+static inline uint32_t assoofs_name_hash(const char *name, unsigned int len) {
+    uint32_t hash = 2166136261u;
+
+    while (len--) {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * Rango de bloques fisicos contiguos que ocupa un fichero a partir de su
+ * bloque logico file_block. Las extensiones de un inodo estan ordenadas por
+ * file_block; las que no caben en el inodo van al bloque extent_block.
+ */
+struct assoofs_extent {
+    uint32_t file_block;
+    uint32_t block_count;
+    uint64_t start_block;
+};
+
+/*
+ * Entrada de la tabla de inodos (ASSOOFS_INODE_SIZE bytes). Un fichero de como
+ * mucho ASSOOFS_INLINE_DATA_MAX bytes guarda su contenido en la propia entrada
+ * (flag ASSOOFS_INODE_INLINE_DATA, extents_count 0); al crecer pasa a bloques
+ * de datos y el mismo espacio se usa para las extensiones.
+ */
 struct assoofs_inode_info {
     mode_t mode;
+    uint32_t extents_count;
     uint64_t inode_no;
-    uint64_t data_block_number;
+    uint64_t extent_block;
     union {
         uint64_t file_size;
         uint64_t dir_children_count;
     };
+    uint32_t flags;
+    uint32_t reserved;
+    union {
+        struct assoofs_extent extents[ASSOOFS_INODE_EXTENTS];
+        char inline_data[ASSOOFS_INLINE_DATA_MAX];
+    };
 };
@@ -0,0 +1,215 @@
+/*
+ * Tracepoints de assoofs. Se activan en tiempo de ejecucion, sin recompilar:
+ *   echo 1 > /sys/kernel/tracing/events/assoofs/enable
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM assoofs
+
+#if !defined(_ASSOOFS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _ASSOOFS_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(assoofs_lookup,
+    TP_PROTO(struct inode *dir, struct dentry *dentry, uint64_t ino),
+    TP_ARGS(dir, dentry, ino),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(unsigned long, dir)
+        __field(uint64_t, ino)
+        __string(name, dentry->d_name.name)
+    ),
+    TP_fast_assign(
+        __entry->dev = dir->i_sb->s_dev;
+        __entry->dir = dir->i_ino;
+        __entry->ino = ino;
+        __assign_str(name, dentry->d_name.name);
+    ),
+    TP_printk("dev %d,%d dir %lu name %s ino %llu",
+              MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir, __get_str(name), __entry->ino)
+);
+
+TRACE_EVENT(assoofs_iget,
+    TP_PROTO(struct super_block *sb, unsigned long ino, bool cached),
+    TP_ARGS(sb, ino, cached),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(unsigned long, ino)
+        __field(bool, cached)
+    ),
+    TP_fast_assign(
+        __entry->dev = sb->s_dev;
+        __entry->ino = ino;
+        __entry->cached = cached;
+    ),
+    TP_printk("dev %d,%d ino %lu %s",
+              MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino, __entry->cached ? "cached" : "read")
+);
+
+TRACE_EVENT(assoofs_read_inode,
+    TP_PROTO(struct super_block *sb, uint64_t ino, int ret),
+    TP_ARGS(sb, ino, ret),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(uint64_t, ino)
+        __field(int, ret)
+    ),
+    TP_fast_assign(
+        __entry->dev = sb->s_dev;
+        __entry->ino = ino;
+        __entry->ret = ret;
+    ),
+    TP_printk("dev %d,%d ino %llu ret %d",
+              MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino, __entry->ret)
+);
+
+TRACE_EVENT(assoofs_write_inode,
+    TP_PROTO(struct inode *inode, int sync),
+    TP_ARGS(inode, sync),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(unsigned long, ino)
+        __field(loff_t, size)
+        __field(int, sync)
+    ),
+    TP_fast_assign(
+        __entry->dev = inode->i_sb->s_dev;
+        __entry->ino = inode->i_ino;
+        __entry->size = inode->i_size;
+        __entry->sync = sync;
+    ),
+    TP_printk("dev %d,%d ino %lu size %lld sync %d",
+              MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino, __entry->size, __entry->sync)
+);
+
+TRACE_EVENT(assoofs_create,
+    TP_PROTO(struct inode *dir, struct inode *inode),
+    TP_ARGS(dir, inode),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(unsigned long, dir)
+        __field(unsigned long, ino)
+        __field(umode_t, mode)
+    ),
+    TP_fast_assign(
+        __entry->dev = dir->i_sb->s_dev;
+        __entry->dir = dir->i_ino;
+        __entry->ino = inode->i_ino;
+        __entry->mode = inode->i_mode;
+    ),
+    TP_printk("dev %d,%d dir %lu ino %lu mode 0%o",
+              MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir, __entry->ino, __entry->mode)
+);
+
+TRACE_EVENT(assoofs_iterate,
+    TP_PROTO(struct inode *dir, loff_t pos),
+    TP_ARGS(dir, pos),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(unsigned long, dir)
+        __field(loff_t, pos)
+    ),
+    TP_fast_assign(
+        __entry->dev = dir->i_sb->s_dev;
+        __entry->dir = dir->i_ino;
+        __entry->pos = pos;
+    ),
+    TP_printk("dev %d,%d dir %lu pos 0x%llx",
+              MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir, __entry->pos)
+);
+
+TRACE_EVENT(assoofs_get_block,
+    TP_PROTO(struct inode *inode, sector_t iblock, int create, uint64_t pblock, unsigned long len, bool new),
+    TP_ARGS(inode, iblock, create, pblock, len, new),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(unsigned long, ino)
+        __field(sector_t, iblock)
+        __field(uint64_t, pblock)
+        __field(unsigned long, len)
+        __field(int, create)
+        __field(bool, new)
+    ),
+    TP_fast_assign(
+        __entry->dev = inode->i_sb->s_dev;
+        __entry->ino = inode->i_ino;
+        __entry->iblock = iblock;
+        __entry->pblock = pblock;
+        __entry->len = len;
+        __entry->create = create;
+        __entry->new = new;
+    ),
+    TP_printk("dev %d,%d ino %lu iblock %llu -> %llu len %lu create %d%s",
+              MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+              (unsigned long long)__entry->iblock, __entry->pblock, __entry->len,
+              __entry->create, __entry->new ? " new" : "")
+);
+
+TRACE_EVENT(assoofs_alloc_blocks,
+    TP_PROTO(struct super_block *sb, uint64_t goal, uint64_t block, uint32_t count, uint64_t scanned),
+    TP_ARGS(sb, goal, block, count, scanned),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(uint64_t, goal)
+        __field(uint64_t, block)
+        __field(uint32_t, count)
+        __field(uint64_t, scanned)
+    ),
+    TP_fast_assign(
+        __entry->dev = sb->s_dev;
+        __entry->goal = goal;
+        __entry->block = block;
+        __entry->count = count;
+        __entry->scanned = scanned;
+    ),
+    TP_printk("dev %d,%d goal %llu block %llu count %u groups scanned %llu",
+              MAJOR(__entry->dev), MINOR(__entry->dev), __entry->goal, __entry->block,
+              __entry->count, __entry->scanned)
+);
+
+DECLARE_EVENT_CLASS(assoofs_page_io,
+    TP_PROTO(struct inode *inode, pgoff_t index, unsigned long nr),
+    TP_ARGS(inode, index, nr),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(unsigned long, ino)
+        __field(pgoff_t, index)
+        __field(unsigned long, nr)
+    ),
+    TP_fast_assign(
+        __entry->dev = inode->i_sb->s_dev;
+        __entry->ino = inode->i_ino;
+        __entry->index = index;
+        __entry->nr = nr;
+    ),
+    TP_printk("dev %d,%d ino %lu index %lu nr %lu",
+              MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino, __entry->index, __entry->nr)
+);
+
+DEFINE_EVENT(assoofs_page_io, assoofs_readpage,
+    TP_PROTO(struct inode *inode, pgoff_t index, unsigned long nr),
+    TP_ARGS(inode, index, nr)
+);
+
+DEFINE_EVENT(assoofs_page_io, assoofs_readahead,
+    TP_PROTO(struct inode *inode, pgoff_t index, unsigned long nr),
+    TP_ARGS(inode, index, nr)
+);
+
+DEFINE_EVENT(assoofs_page_io, assoofs_writepage,
+    TP_PROTO(struct inode *inode, pgoff_t index, unsigned long nr),
+    TP_ARGS(inode, index, nr)
+);
+
+DEFINE_EVENT(assoofs_page_io, assoofs_writepages,
+    TP_PROTO(struct inode *inode, pgoff_t index, unsigned long nr),
+    TP_ARGS(inode, index, nr)
+);
+
+#endif /* _ASSOOFS_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE assoofs_trace
+#include <trace/define_trace.h>
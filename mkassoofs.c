@@ -1,155 +1,1320 @@
 #include <unistd.h>
 #include <stdio.h>
+#include <stddef.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <arpa/inet.h>
 #include "assoofs.h"
 
-#define WELCOMEFILE_DATABLOCK_NUMBER (ASSOOFS_LAST_RESERVED_BLOCK + 1)
-#define WELCOMEFILE_INODE_NUMBER (ASSOOFS_LAST_RESERVED_INODE + 1)
+#define FIRST_FILE_INODE_NUMBER ((uint64_t)ASSOOFS_LAST_RESERVED_INODE + 1)
 
-static int write_superblock(int fd) {
-    struct assoofs_super_block_info sb = {
-        .version = 1,
-        .magic = ASSOOFS_MAGIC,
-        .block_size = ASSOOFS_DEFAULT_BLOCK_SIZE,
-        .inodes_count = WELCOMEFILE_INODE_NUMBER,
-        .free_blocks = (~0) & ~(15),
-    };
+/*
+ * Los datos se leen y se escriben en trozos de IO_CHUNK bytes, con buffers
+ * alineados a IO_ALIGN: cada llamada mueve mucho y el dispositivo solo recibe
+ * bloques enteros, sin lecturas para completar uno a medias.
+ */
+#define IO_CHUNK (4 << 20)
+#define IO_ALIGN 4096
+#define INLINE_BATCH 256    /* ficheros pequenos que lee cada trabajo de read_sources */
+
+/* Superbloque de jbd2 (include/linux/jbd2.h), en big endian */
+#define JBD2_MAGIC_NUMBER 0xc03b3998U
+#define JBD2_SUPERBLOCK_V2 4
+
+struct jbd2_superblock {
+    uint32_t h_magic;
+    uint32_t h_blocktype;
+    uint32_t h_sequence;
+    uint32_t s_blocksize;
+    uint32_t s_maxlen;      /* bloques del diario, contando este */
+    uint32_t s_first;       /* primer bloque de registro */
+    uint32_t s_sequence;    /* primera transaccion esperada */
+    uint32_t s_start;       /* 0: diario vacio, no hay nada que repetir */
+};
+
+/*
+ * Fichero o directorio del volumen que se esta construyendo. info es ya su
+ * entrada de la tabla de inodos; el nodo i tiene el inodo node_inode_no(i).
+ */
+struct node {
+    struct assoofs_inode_info info;
+    char *name;
+    uint8_t name_len;
+    uint64_t parent;
+    uint64_t *children;     /* solo directorios; place_dirs los ordena por hash */
+    uint64_t nchildren, children_cap;
+    uint32_t leaves;        /* hojas del directorio, calculadas en place_dirs */
+    char *path;             /* con -d, fichero del que salen los datos */
+};
+
+/*
+ * Arbol en memoria del volumen. Los datos de los ficheros ocupan bloques
+ * consecutivos, en el orden en que aparecen, y detras van los directorios.
+ * Con -T hay que buscar por nombre: lookup es una tabla hash abierta de
+ * (padre, nombre) a indice + 1.
+ */
+struct tree {
+    struct node *nodes;
+    uint64_t count, cap;
+    uint64_t *lookup;
+    uint64_t lookup_size;
+    uint64_t block_size;
+    uint64_t blocks;        /* del dispositivo */
+    uint64_t next_block;    /* primer bloque sin usar */
+    uint64_t *files;        /* nodos con bloques de datos, por orden de bloque */
+    uint64_t nfiles, files_cap;
+    uint64_t *inlines;      /* con -d, ficheros que caben en el inodo */
+    uint64_t ninlines, inlines_cap;
+};
+
+/* Escritura secuencial de bloques desde pos, a traves de un buffer de IO_CHUNK */
+struct out {
+    int fd;
+    char *buf;
+    size_t len;
+    uint64_t pos;           /* byte del dispositivo que corresponde a buf[0] */
+};
+
+/* Lectura secuencial del tar, que puede llegar por una tuberia */
+struct in {
+    int fd;
+    char *buf;
+    size_t start, len;
+};
+
+static uint64_t device_blocks(int fd, uint64_t block_size) {
+    struct stat st;
+    uint64_t size;
+
+    if (fstat(fd, &st) == -1)
+        return 0;
+    if (S_ISBLK(st.st_mode)) {
+        if (ioctl(fd, BLKGETSIZE64, &size) == -1)
+            return 0;
+    } else {
+        size = st.st_size;
+    }
+    return size / block_size;
+}
+
+static void *alloc_aligned(size_t len) {
+    void *p;
+
+    if (posix_memalign(&p, IO_ALIGN, len))
+        return NULL;
+    memset(p, 0, len);
+    return p;
+}
+
+static int pwrite_all(int fd, const void *buf, size_t len, uint64_t pos) {
     ssize_t ret;
 
-    ret = write(fd, &sb, sizeof(sb));
-    if (ret != ASSOOFS_DEFAULT_BLOCK_SIZE) {
-        printf("Bytes written [%d] are not equal to the default block size.\n", (int)ret);
+    while (len) {
+        ret = pwrite(fd, buf, len, pos);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -1;
+        buf = (const char *)buf + ret;
+        len -= ret;
+        pos += ret;
+    }
+    return 0;
+}
+
+// Dobla la capacidad de un vector del arbol; sin memoria no hay nada que hacer
+static void *grow_array(void *p, uint64_t *cap, size_t size) {
+    uint64_t n = *cap ? *cap * 2 : 16;
+
+    p = realloc(p, n * size);
+    if (!p) {
+        printf("Not enough memory for the file tree.\n");
+        exit(1);
+    }
+    *cap = n;
+    return p;
+}
+
+static uint64_t node_inode_no(uint64_t index) {
+    return index ? FIRST_FILE_INODE_NUMBER + index - 1 : (uint64_t)ASSOOFS_ROOTDIR_INODE_NUMBER;
+}
+
+static uint64_t lookup_slot(const struct tree *t, uint64_t parent, const char *name, unsigned int len) {
+    return (assoofs_name_hash(name, len) ^ (parent * 0x9e3779b97f4a7c15ULL)) & (t->lookup_size - 1);
+}
+
+static void lookup_insert(struct tree *t, uint64_t index) {
+    struct node *n = &t->nodes[index];
+    uint64_t i = lookup_slot(t, n->parent, n->name, n->name_len);
+
+    while (t->lookup[i])
+        i = (i + 1) & (t->lookup_size - 1);
+    t->lookup[i] = index + 1;
+}
+
+// Hijo name de parent, o 0 si no existe: el nodo 0 es la raiz, que no es hijo de nadie
+static uint64_t lookup_child(const struct tree *t, uint64_t parent, const char *name, unsigned int len) {
+    const struct node *n;
+    uint64_t i = lookup_slot(t, parent, name, len);
+
+    for (; t->lookup[i]; i = (i + 1) & (t->lookup_size - 1)) {
+        n = &t->nodes[t->lookup[i] - 1];
+        if (n->parent == parent && n->name_len == len && !memcmp(n->name, name, len))
+            return t->lookup[i] - 1;
+    }
+    return 0;
+}
+
+// Anade un hijo de parent y devuelve su indice. El primer nodo es la raiz
+static uint64_t tree_add(struct tree *t, uint64_t parent, const char *name, unsigned int len, mode_t mode) {
+    struct node *n, *p;
+    uint64_t index = t->count, i;
+
+    if (t->count == t->cap)
+        t->nodes = grow_array(t->nodes, &t->cap, sizeof(*t->nodes));
+    n = &t->nodes[t->count++];
+    memset(n, 0, sizeof(*n));
+    n->info.mode = mode;
+    n->info.inode_no = node_inode_no(index);
+    n->parent = parent;
+    if (!index)
+        return index;
+
+    n->name = malloc(len);
+    if (!n->name) {
+        printf("Not enough memory for the file tree.\n");
+        exit(1);
+    }
+    memcpy(n->name, name, len);
+    n->name_len = len;
+    p = &t->nodes[parent];
+    if (p->nchildren == p->children_cap)
+        p->children = grow_array(p->children, &p->children_cap, sizeof(*p->children));
+    p->children[p->nchildren++] = index;
+
+    if (!t->lookup)
+        return index;
+    if (t->count * 2 <= t->lookup_size) {
+        lookup_insert(t, index);
+        return index;
+    }
+    free(t->lookup);
+    t->lookup_size *= 2;
+    t->lookup = calloc(t->lookup_size, sizeof(*t->lookup));
+    if (!t->lookup) {
+        printf("Not enough memory for the file tree.\n");
+        exit(1);
+    }
+    for (i = 1; i < t->count; i++)
+        lookup_insert(t, i);
+    return index;
+}
+
+/*
+ * Reserva los bloques de un fichero de size bytes a continuacion de los
+ * anteriores, en una sola extension. Si cabe en el inodo no ocupa ninguno.
+ */
+static int place_file(struct tree *t, uint64_t index, uint64_t size, const char *name) {
+    struct node *n = &t->nodes[index];
+    uint64_t count = (size + t->block_size - 1) / t->block_size;
+
+    n->info.file_size = size;
+    if (size <= ASSOOFS_INLINE_DATA_MAX) {
+        n->info.flags = ASSOOFS_INODE_INLINE_DATA;
+        return 0;
+    }
+    if (count > UINT32_MAX || t->next_block + count > t->blocks) {
+        printf("No space left on the device for %s.\n", name);
         return -1;
     }
+    n->info.extents_count = 1;
+    n->info.extents[0].file_block = 0;
+    n->info.extents[0].start_block = t->next_block;
+    n->info.extents[0].block_count = count;
+    t->next_block += count;
+    if (t->nfiles == t->files_cap)
+        t->files = grow_array(t->files, &t->files_cap, sizeof(*t->files));
+    t->files[t->nfiles++] = index;
+    return 0;
+}
 
-    printf("Super block written succesfully.\n");
+static int out_flush(struct out *o) {
+    if (!o->len)
+        return 0;
+    if (pwrite_all(o->fd, o->buf, o->len, o->pos)) {
+        perror("Error writing the data blocks");
+        return -1;
+    }
+    o->pos += o->len;
+    memset(o->buf, 0, o->len); // Lo que no se rellene despues queda a cero
+    o->len = 0;
     return 0;
 }
 
-static int write_root_inode(int fd) {
+// Siguiente bloque del buffer de salida, a cero
+static char *out_block(struct out *o, uint64_t block_size) {
+    char *block;
+
+    if (o->len == IO_CHUNK && out_flush(o))
+        return NULL;
+    block = o->buf + o->len;
+    o->len += block_size;
+    return block;
+}
+
+// Lee len bytes del tar en dst, o los salta si dst es NULL. Devuelve menos al final del tar
+static ssize_t in_read(struct in *in, void *dst, size_t len) {
+    size_t done = 0, n;
     ssize_t ret;
 
-    struct assoofs_inode_info root_inode;
+    while (done < len) {
+        if (in->start == in->len) {
+            ret = read(in->fd, in->buf, IO_CHUNK);
+            if (ret == -1 && errno == EINTR)
+                continue;
+            if (ret <= 0)
+                return ret ? -1 : (ssize_t)done;
+            in->start = 0;
+            in->len = ret;
+        }
+        n = in->len - in->start < len - done ? in->len - in->start : len - done;
+        if (dst)
+            memcpy((char *)dst + done, in->buf + in->start, n);
+        in->start += n;
+        done += n;
+    }
+    return done;
+}
 
-    root_inode.mode = S_IFDIR;
-    root_inode.inode_no = ASSOOFS_ROOTDIR_INODE_NUMBER;
-    root_inode.data_block_number = ASSOOFS_ROOTDIR_BLOCK_NUMBER;
-    root_inode.dir_children_count = 1;
+static int in_read_all(struct in *in, void *dst, size_t len) {
+    if (in_read(in, dst, len) != (ssize_t)len) {
+        printf("Unexpected end of the tar archive.\n");
+        return -1;
+    }
+    return 0;
+}
 
-    ret = write(fd, &root_inode, sizeof(root_inode));
 
-    if (ret != sizeof(root_inode)) {
-        printf("The inode store was not written properly.\n");
+/*
+ *  Ficheros de un directorio (-d)
+ */
+
+/*
+ * Recorre dir sin seguir enlaces y anade sus ficheros y subdirectorios al
+ * arbol, reservando ya sus bloques de datos. El contenido se lee despues, en
+ * paralelo, con read_sources.
+ */
+static int scan_dir(struct tree *t, uint64_t parent, const char *dir) {
+    struct dirent *de;
+    struct stat st;
+    DIR *d;
+    char *path;
+    size_t len;
+    uint64_t index;
+    int ret = 0;
+
+    d = opendir(dir);
+    if (!d) {
+        printf("Error opening %s: %s\n", dir, strerror(errno));
         return -1;
     }
+    while (!ret && (de = readdir(d))) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+        len = strlen(de->d_name);
+        path = malloc(strlen(dir) + len + 2);
+        if (!path) {
+            printf("Not enough memory for the file tree.\n");
+            ret = -1;
+            break;
+        }
+        sprintf(path, "%s/%s", dir, de->d_name);
+        if (lstat(path, &st) == -1) {
+            printf("Error reading %s: %s\n", path, strerror(errno));
+            free(path);
+            ret = -1;
+            break;
+        }
+        if (len > ASSOOFS_FILENAME_MAXLEN || (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode))) {
+            printf("Skipping %s: only regular files and directories with names of up to %d bytes are supported.\n", path, ASSOOFS_FILENAME_MAXLEN);
+            free(path);
+            continue;
+        }
 
-    printf("root directory inode written succesfully.\n");
-    return 0;
+        index = tree_add(t, parent, de->d_name, len, st.st_mode & (S_IFMT | 07777));
+        if (S_ISDIR(st.st_mode)) {
+            ret = scan_dir(t, index, path);
+            free(path);
+            continue;
+        }
+        t->nodes[index].path = path;
+        ret = place_file(t, index, st.st_size, path);
+        if (!ret && !t->nodes[index].info.extents_count && st.st_size) {
+            if (t->ninlines == t->inlines_cap)
+                t->inlines = grow_array(t->inlines, &t->inlines_cap, sizeof(*t->inlines));
+            t->inlines[t->ninlines++] = index;
+        }
+    }
+    closedir(d);
+    return ret;
+}
+
+/*
+ * Trabajo repartido entre los hilos de read_sources. Los datos de todos los
+ * ficheros forman una zona contigua del dispositivo que se divide en trozos de
+ * IO_CHUNK bytes: cada hilo lee de los ficheros lo que cae en su trozo y lo
+ * escribe de una vez. Detras de los trozos van los lotes de ficheros que caben
+ * en el inodo.
+ */
+struct readers {
+    pthread_mutex_t lock;
+    struct tree *t;
+    int fd;
+    uint64_t data_start, data_end;  /* en bytes */
+    uint64_t chunks, jobs, next;
+    int error;
+};
+
+// Primer fichero cuyos datos acaban despues del byte pos
+static uint64_t first_file_after(const struct tree *t, uint64_t pos) {
+    const struct assoofs_inode_info *info;
+    uint64_t lo = 0, hi = t->nfiles, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        info = &t->nodes[t->files[mid]].info;
+        if (info->extents[0].start_block * t->block_size + info->file_size <= pos)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
 }
 
-static int write_welcome_inode(int fd, const struct assoofs_inode_info *i) {
-    off_t nbytes;
+static int read_file_range(const char *path, char *dst, uint64_t offset, uint64_t len) {
     ssize_t ret;
+    int fd;
 
-    ret = write(fd, i, sizeof(*i));
-    if (ret != sizeof(*i)) {
-        printf("The welcomefile inode was not written properly.\n");
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        printf("Error opening %s: %s\n", path, strerror(errno));
         return -1;
     }
-    printf("welcomefile inode written succesfully.\n");
+    while (len) {
+        ret = pread(fd, dst, len, offset);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0) {
+            printf("Error reading %s: %s\n", path, ret ? strerror(errno) : "the file has shrunk");
+            close(fd);
+            return -1;
+        }
+        dst += ret;
+        offset += ret;
+        len -= ret;
+    }
+    close(fd);
+    return 0;
+}
+
+static int read_chunk(struct readers *r, char *buf, uint64_t chunk) {
+    struct tree *t = r->t;
+    uint64_t start = r->data_start + chunk * IO_CHUNK, end, i, fstart, fend, from, to;
+    struct node *n;
 
-    nbytes = ASSOOFS_DEFAULT_BLOCK_SIZE - (sizeof(*i) * 2);
-    ret = lseek(fd, nbytes, SEEK_CUR);
-    if (ret == (off_t)-1) {
-        printf("The padding bytes are not written properly.\n");
+    end = start + IO_CHUNK < r->data_end ? start + IO_CHUNK : r->data_end;
+    memset(buf, 0, end - start);
+    for (i = first_file_after(t, start); i < t->nfiles; i++) {
+        n = &t->nodes[t->files[i]];
+        fstart = n->info.extents[0].start_block * t->block_size;
+        fend = fstart + n->info.file_size;
+        if (fstart >= end)
+            break;
+        from = fstart > start ? fstart : start;
+        to = fend < end ? fend : end;
+        if (read_file_range(n->path, buf + (from - start), from - fstart, to - from))
+            return -1;
+    }
+    if (pwrite_all(r->fd, buf, end - start, start)) {
+        perror("Error writing the data blocks");
         return -1;
     }
+    return 0;
+}
 
-    printf("inode store padding bytes (after two inodes) written sucessfully.\n");
+static int read_inlines(struct readers *r, uint64_t batch) {
+    struct tree *t = r->t;
+    uint64_t i, end = (batch + 1) * INLINE_BATCH;
+    struct node *n;
+
+    for (i = batch * INLINE_BATCH; i < t->ninlines && i < end; i++) {
+        n = &t->nodes[t->inlines[i]];
+        if (read_file_range(n->path, n->info.inline_data, 0, n->info.file_size))
+            return -1;
+    }
     return 0;
 }
 
-int write_dirent(int fd, const struct assoofs_dir_record_entry *record) {
-    ssize_t nbytes = sizeof(*record), ret;
+static void *reader_thread(void *arg) {
+    struct readers *r = arg;
+    uint64_t job;
+    char *buf;
+    int ret = 0;
 
-    ret = write(fd, record, nbytes);
-    if (ret != nbytes) {
-        printf("Writing the rootdirectory datablock (name+inode_no pair for welcomefile) has failed.\n");
+    buf = alloc_aligned(IO_CHUNK);
+    if (!buf) {
+        printf("Not enough memory for the data buffers.\n");
+        ret = -1;
+    }
+    while (!ret) {
+        pthread_mutex_lock(&r->lock);
+        job = r->error ? r->jobs : r->next++;
+        pthread_mutex_unlock(&r->lock);
+        if (job >= r->jobs)
+            break;
+        ret = job < r->chunks ? read_chunk(r, buf, job) : read_inlines(r, job - r->chunks);
+    }
+    if (ret) {
+        pthread_mutex_lock(&r->lock);
+        r->error = 1;
+        pthread_mutex_unlock(&r->lock);
+    }
+    free(buf);
+    return NULL;
+}
+
+/*
+ * Copia el contenido de los ficheros que encontro scan_dir con hasta threads
+ * hilos: los que tienen bloques a los bloques [data_block, data_end) y los
+ * pequenos a su inodo.
+ */
+static int read_sources(struct tree *t, int fd, uint64_t data_block, uint64_t data_end, long threads) {
+    struct readers r = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .t = t,
+        .fd = fd,
+        .data_start = data_block * t->block_size,
+        .data_end = data_end * t->block_size,
+    };
+    pthread_t *tids;
+    long i, started;
+
+    r.chunks = (r.data_end - r.data_start + IO_CHUNK - 1) / IO_CHUNK;
+    r.jobs = r.chunks + (t->ninlines + INLINE_BATCH - 1) / INLINE_BATCH;
+    if ((uint64_t)threads > r.jobs)
+        threads = r.jobs ? r.jobs : 1;
+    tids = calloc(threads, sizeof(*tids));
+    if (!tids) {
+        printf("Not enough memory for the reader threads.\n");
         return -1;
     }
-    printf("root directory datablocks (name+inode_no pair for welcomefile) written succesfully.\n");
+    for (started = 0; started < threads; started++)
+        if (pthread_create(&tids[started], NULL, reader_thread, &r))
+            break;
+    if (!started)
+        reader_thread(&r);
+    for (i = 0; i < started; i++)
+        pthread_join(tids[i], NULL);
+    free(tids);
+    if (r.error)
+        return -1;
+    printf("file data (%llu files, %llu blocks) written succesfully by %ld threads.\n",
+           (unsigned long long)(t->nfiles + t->ninlines), (unsigned long long)(data_end - data_block), started ? started : 1);
+    return 0;
+}
 
-    nbytes = ASSOOFS_DEFAULT_BLOCK_SIZE - sizeof(*record);
-    ret = lseek(fd, nbytes, SEEK_CUR);
-    if (ret == (off_t)-1) {
-        printf("Writing the padding for rootdirectory children datablock has failed.\n");
+
+/*
+ *  Ficheros de un tar (-T), leido en una sola pasada
+ */
+
+#define TAR_BLOCK 512
+
+struct tar_header {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+};
+
+// Relleno hasta el siguiente bloque del tar detras de size bytes de datos
+static uint64_t tar_padding(uint64_t size) {
+    return (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+}
+
+// Campo numerico de la cabecera: octal o, con tamanos grandes de GNU tar, binario con el bit alto del primer byte
+static uint64_t tar_number(const char *field, size_t len) {
+    uint64_t value = 0;
+    size_t i = 0;
+
+    if (len && (field[0] & 0x80)) {
+        value = field[0] & 0x7f;
+        for (i = 1; i < len; i++)
+            value = value << 8 | (unsigned char)field[i];
+        return value;
+    }
+    while (i < len && field[i] == ' ')
+        i++;
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; i++)
+        value = value * 8 + field[i] - '0';
+    return value;
+}
+
+// La suma de la cabecera se calcula con chksum lleno de espacios
+static int tar_checksum_ok(const struct tar_header *h) {
+    const unsigned char *p = (const unsigned char *)h;
+    uint64_t sum = 0, i;
+
+    for (i = 0; i < TAR_BLOCK; i++)
+        sum += i >= offsetof(struct tar_header, chksum) && i < offsetof(struct tar_header, typeflag) ? ' ' : p[i];
+    return sum == tar_number(h->chksum, sizeof(h->chksum));
+}
+
+static int tar_skip(struct in *in, uint64_t len) {
+    return in_read_all(in, NULL, len);
+}
+
+// Cabecera extendida pax: de sus registros solo se usan path y size
+static int tar_pax(struct in *in, uint64_t len, char **path, uint64_t *size) {
+    char *buf, *p, *key, *value, *end;
+    unsigned long reclen;
+
+    buf = malloc(len + 1);
+    if (!buf || in_read_all(in, buf, len) || tar_skip(in, tar_padding(len))) {
+        free(buf);
         return -1;
     }
-    printf("Padding after the rootdirectory children written succesfully.\n");
+    buf[len] = '\0';
+    // Cada registro es "<longitud> <clave>=<valor>\n"
+    for (p = buf; p < buf + len; p += reclen) {
+        reclen = strtoul(p, &key, 10);
+        if (!reclen || p + reclen > buf + len || *key != ' ')
+            break;
+        key++;
+        end = p + reclen - 1;
+        value = memchr(key, '=', end - key);
+        if (!value)
+            continue;
+        *value++ = '\0';
+        *end = '\0';
+        if (!strcmp(key, "path")) {
+            free(*path);
+            *path = strdup(value);
+        } else if (!strcmp(key, "size")) {
+            *size = strtoull(value, NULL, 10);
+        }
+    }
+    free(buf);
     return 0;
 }
 
-int write_block(int fd, char *block, size_t len) {
-    ssize_t ret;
+/*
+ * Busca el directorio padre de path, creando los intermedios que el tar no
+ * haya traido antes, y deja en *name el ultimo componente (NULL si path es la
+ * raiz). path se modifica.
+ */
+static int tar_resolve(struct tree *t, char *path, uint64_t *parent, char **name) {
+    char *component, *next;
+    uint64_t dir = 0, child;
+
+    *name = NULL;
+    for (component = path; component; component = next) {
+        next = strchr(component, '/');
+        if (next)
+            *next++ = '\0';
+        if (!*component || !strcmp(component, "."))
+            continue;
+        if (!strcmp(component, "..") || strlen(component) > ASSOOFS_FILENAME_MAXLEN)
+            return -1;
+        if (*name) {
+            child = lookup_child(t, dir, *name, strlen(*name));
+            if (!child)
+                child = tree_add(t, dir, *name, strlen(*name), S_IFDIR | 0755);
+            else if (!S_ISDIR(t->nodes[child].info.mode))
+                return -1;
+            dir = child;
+        }
+        *name = component;
+    }
+    *parent = dir;
+    return 0;
+}
 
-    ret = write(fd, block, len);
-    if (ret != len) {
-        printf("Writing file body has failed.\n");
+// Lleva size bytes de datos del tar a su sitio en el buffer de salida
+static int tar_copy_data(struct tree *t, struct in *in, struct out *o, uint64_t size) {
+    size_t n;
+
+    while (size) {
+        if (o->len == IO_CHUNK && out_flush(o))
+            return -1;
+        n = IO_CHUNK - o->len < size ? IO_CHUNK - o->len : size;
+        if (in_read_all(in, o->buf + o->len, n))
+            return -1;
+        o->len += n;
+        size -= n;
+    }
+    o->len = (o->len + t->block_size - 1) / t->block_size * t->block_size; // El resto del ultimo bloque ya esta a cero
+    return 0;
+}
+
+/*
+ * Lee el tar de fd y escribe en dev los datos de sus ficheros segun llegan, en
+ * bloques consecutivos desde t->next_block. Solo se admiten ficheros regulares
+ * y directorios: los enlaces y los ficheros especiales se saltan con un aviso.
+ */
+static int read_tar(struct tree *t, int fd, int dev) {
+    struct in in = { .fd = fd };
+    struct out o = { .fd = dev, .pos = t->next_block * t->block_size };
+    struct tar_header h;
+    char *path = NULL, *long_name = NULL, *name;
+    uint64_t size, pax_size = 0, parent, index;
+    int ret = -1, skip, has_pax_size = 0;
+    mode_t mode;
+
+    in.buf = alloc_aligned(IO_CHUNK);
+    o.buf = alloc_aligned(IO_CHUNK);
+    if (!in.buf || !o.buf) {
+        printf("Not enough memory for the data buffers.\n");
+        goto out;
+    }
+
+    for (;;) {
+        if (in_read_all(&in, &h, sizeof(h)))
+            goto out;
+        if (!h.name[0]) // Un bloque a cero marca el final
+            break;
+        if (!tar_checksum_ok(&h)) {
+            printf("Bad tar header checksum.\n");
+            goto out;
+        }
+        size = tar_number(h.size, sizeof(h.size));
+
+        switch (h.typeflag) {
+        case 'L':   // Nombre largo de GNU tar para la entrada siguiente
+            free(long_name);
+            long_name = calloc(1, size + 1);
+            if (!long_name || in_read_all(&in, long_name, size) || tar_skip(&in, tar_padding(size)))
+                goto out;
+            continue;
+        case 'x':   // Cabecera pax de la entrada siguiente
+            pax_size = UINT64_MAX;
+            if (tar_pax(&in, size, &long_name, &pax_size))
+                goto out;
+            has_pax_size = pax_size != UINT64_MAX;
+            continue;
+        case 'g':   // Cabecera pax global
+            if (tar_skip(&in, size + tar_padding(size)))
+                goto out;
+            continue;
+        }
+
+        if (has_pax_size)
+            size = pax_size;
+        has_pax_size = 0;
+        free(path);
+        if (long_name) {
+            path = long_name;
+            long_name = NULL;
+        } else {
+            path = malloc(sizeof(h.prefix) + sizeof(h.name) + 2);
+            if (!path)
+                goto out;
+            if (!memcmp(h.magic, "ustar", 5) && h.prefix[0])
+                sprintf(path, "%.*s/%.*s", (int)sizeof(h.prefix), h.prefix, (int)sizeof(h.name), h.name);
+            else
+                sprintf(path, "%.*s", (int)sizeof(h.name), h.name);
+        }
+        mode = tar_number(h.mode, sizeof(h.mode)) & 07777;
+
+        skip = 1;
+        if (h.typeflag != '0' && h.typeflag != '\0' && h.typeflag != '7' && h.typeflag != '5')
+            printf("Skipping %s: only regular files and directories are supported.\n", path);
+        else if (tar_resolve(t, path, &parent, &name))
+            printf("Skipping %s: bad path.\n", path);
+        else if (!name && h.typeflag == '5')   // La propia raiz, "./"
+            t->nodes[0].info.mode = S_IFDIR | mode;
+        else if (name && (index = lookup_child(t, parent, name, strlen(name))) && h.typeflag == '5' && S_ISDIR(t->nodes[index].info.mode))
+            t->nodes[index].info.mode = S_IFDIR | mode;    // Ya creado como directorio intermedio
+        else if (!name || index)
+            printf("Skipping %s: duplicated entry.\n", path);
+        else
+            skip = 0;
+        if (skip) {
+            if (tar_skip(&in, size + tar_padding(size)))
+                goto out;
+            continue;
+        }
+
+        if (h.typeflag == '5') {
+            tree_add(t, parent, name, strlen(name), S_IFDIR | mode);
+            continue;
+        }
+        index = tree_add(t, parent, name, strlen(name), S_IFREG | mode);
+        if (place_file(t, index, size, name))
+            goto out;
+        if (t->nodes[index].info.extents_count ? tar_copy_data(t, &in, &o, size) : in_read_all(&in, t->nodes[index].info.inline_data, size))
+            goto out;
+        if (tar_skip(&in, tar_padding(size)))
+            goto out;
+    }
+    ret = out_flush(&o);
+    if (!ret)
+        printf("tar archive (%llu files and directories) written succesfully.\n", (unsigned long long)t->count - 1);
+out:
+    free(path);
+    free(long_name);
+    free(in.buf);
+    free(o.buf);
+    return ret;
+}
+
+
+/*
+ *  Directorios
+ */
+
+static struct tree *sort_tree; // qsort no pasa contexto a la comparacion
+
+static int cmp_child_hash(const void *a, const void *b) {
+    const struct node *x = &sort_tree->nodes[*(const uint64_t *)a];
+    const struct node *y = &sort_tree->nodes[*(const uint64_t *)b];
+    uint32_t hx = assoofs_name_hash(x->name, x->name_len), hy = assoofs_name_hash(y->name, y->name_len);
+
+    return hx < hy ? -1 : hx > hy;
+}
+
+/*
+ * Reparte las entradas del directorio, ya ordenadas por hash, en hojas llenas
+ * y, si index no es NULL, rellena el indice. Como al partir una hoja en el
+ * modulo, un mismo hash nunca queda repartido entre dos. Devuelve el numero de
+ * hojas, o 0 si no caben en el indice.
+ */
+static uint32_t dir_leaves(const struct tree *t, const struct node *dir, struct assoofs_dir_index *index) {
+    uint64_t max = (t->block_size - sizeof(struct assoofs_dir_index)) / sizeof(struct assoofs_dir_index_entry);
+    uint64_t offset = 0, len, i;
+    uint32_t leaves = 1, hash, prev = 0;
+    const struct node *n;
+
+    if (index) {
+        index->count = 1;
+        index->entries[0].hash = 0;
+        index->entries[0].block = 1;
+    }
+    for (i = 0; i < dir->nchildren; i++) {
+        n = &t->nodes[dir->children[i]];
+        hash = assoofs_name_hash(n->name, n->name_len);
+        len = ASSOOFS_DIR_REC_LEN(n->name_len);
+        if (offset + len > t->block_size) {
+            if (hash == prev || leaves == max)
+                return 0;
+            if (index) {
+                index->entries[leaves].hash = hash;
+                index->entries[leaves].block = leaves + 1;
+                index->count = leaves + 1;
+            }
+            leaves++;
+            offset = 0;
+        }
+        offset += len;
+        prev = hash;
+    }
+    return leaves;
+}
+
+/*
+ * Coloca los directorios detras de los datos, cada uno en una extension: el
+ * bloque logico 0 con el indice y las hojas a continuacion.
+ */
+static int place_dirs(struct tree *t) {
+    struct node *n;
+    uint64_t i;
+
+    sort_tree = t;
+    for (i = 0; i < t->count; i++) {
+        n = &t->nodes[i];
+        if (!S_ISDIR(n->info.mode))
+            continue;
+        qsort(n->children, n->nchildren, sizeof(*n->children), cmp_child_hash);
+        n->leaves = dir_leaves(t, n, NULL);
+        if (!n->leaves) {
+            printf("Too many entries in the directory %.*s.\n", i ? n->name_len : 1, i ? n->name : "/");
+            return -1;
+        }
+        if (t->next_block + 1 + n->leaves > t->blocks) {
+            printf("No space left on the device for the directories.\n");
+            return -1;
+        }
+        n->info.dir_children_count = n->nchildren;
+        n->info.extents_count = 1;
+        n->info.extents[0].file_block = 0;
+        n->info.extents[0].start_block = t->next_block;
+        n->info.extents[0].block_count = 1 + n->leaves;
+        t->next_block += 1 + n->leaves;
+    }
+    return 0;
+}
+
+/*
+ * Escribe los bloques de los directorios, desde first_block y en el orden de
+ * place_dirs. Las hojas se rellenan como en assoofs_dir_leaf_append: la ultima
+ * entrada de cada una llega hasta el final del bloque.
+ */
+static int write_dirs(const struct tree *t, int fd, uint64_t first_block) {
+    struct out o = { .fd = fd, .pos = first_block * t->block_size };
+    struct assoofs_dir_record_entry *record, *last = NULL;
+    const struct node *dir, *n;
+    char *block, *leaf;
+    uint64_t i, j, offset = 0, ndirs = 0;
+
+    o.buf = alloc_aligned(IO_CHUNK);
+    if (!o.buf) {
+        printf("Not enough memory for the data buffers.\n");
+        return -1;
+    }
+    for (i = 0; i < t->count; i++) {
+        dir = &t->nodes[i];
+        if (!S_ISDIR(dir->info.mode))
+            continue;
+        ndirs++;
+        if (!(block = out_block(&o, t->block_size)))
+            goto err;
+        dir_leaves(t, dir, (struct assoofs_dir_index *)block);
+
+        leaf = NULL;
+        for (j = 0; j < dir->nchildren; j++) {
+            n = &t->nodes[dir->children[j]];
+            if (!leaf || offset + ASSOOFS_DIR_REC_LEN(n->name_len) > t->block_size) {
+                if (!(leaf = out_block(&o, t->block_size)))
+                    goto err;
+                offset = 0;
+                last = NULL;
+            }
+            record = (struct assoofs_dir_record_entry *)(leaf + offset);
+            if (last)
+                last->rec_len = assoofs_rec_len_to_disk((char *)record - (char *)last);
+            record->inode_no = n->info.inode_no;
+            record->rec_len = assoofs_rec_len_to_disk(t->block_size - offset);
+            record->name_len = n->name_len;
+            record->file_type = S_ISDIR(n->info.mode) ? ASSOOFS_FT_DIR : ASSOOFS_FT_REG_FILE;
+            memcpy(record->filename, n->name, n->name_len);
+            offset += ASSOOFS_DIR_REC_LEN(n->name_len);
+            last = record;
+        }
+        if (!leaf) { // Directorio vacio: una hoja con una sola entrada libre
+            if (!(leaf = out_block(&o, t->block_size)))
+                goto err;
+            ((struct assoofs_dir_record_entry *)leaf)->rec_len = assoofs_rec_len_to_disk(t->block_size);
+        }
+    }
+    if (out_flush(&o))
+        goto err;
+    free(o.buf);
+    printf("directory blocks (%llu directories) written succesfully.\n", (unsigned long long)ndirs);
+    return 0;
+err:
+    free(o.buf);
+    return -1;
+}
+
+
+/*
+ *  Metadatos del volumen
+ */
+
+static int write_zeros(int fd, uint64_t len, uint64_t pos);
+
+static int write_superblock(int fd, const struct assoofs_super_block_info *sb) {
+    if (pwrite_all(fd, sb, sizeof(*sb), 0) || write_zeros(fd, sb->block_size - sizeof(*sb), sizeof(*sb))) {
+        printf("The super block was not written properly.\n");
+        return -1;
+    }
+
+    printf("Super block written succesfully.\n");
+    return 0;
+}
+
+/*
+ * Escribe len bytes a cero desde pos. La tabla de inodos se pone a cero entera
+ * para que las entradas libres tengan inode_no == 0 aunque el dispositivo
+ * tuviese datos.
+ */
+static int write_zeros(int fd, uint64_t len, uint64_t pos) {
+    static char zeros[1 << 20];
+    size_t chunk;
+
+    while (len) {
+        chunk = len < sizeof(zeros) ? len : sizeof(zeros);
+        if (pwrite_all(fd, zeros, chunk, pos))
+            return -1;
+        len -= chunk;
+        pos += chunk;
+    }
+    return 0;
+}
+
+/*
+ * Inodo del diario: un fichero normal, sin entrada en ningun directorio, con
+ * una sola extension. Sin diario la entrada queda a cero.
+ */
+static void fill_journal_inode(struct assoofs_inode_info *journal_inode, const struct assoofs_super_block_info *sb, uint64_t journal_block, uint64_t journal_blocks) {
+    memset(journal_inode, 0, sizeof(*journal_inode));
+    if (journal_blocks) {
+        journal_inode->mode = S_IFREG | 0600;
+        journal_inode->inode_no = ASSOOFS_JOURNAL_INODE_NUMBER;
+        journal_inode->extents_count = 1;
+        journal_inode->extents[0].file_block = 0;
+        journal_inode->extents[0].start_block = journal_block;
+        journal_inode->extents[0].block_count = journal_blocks;
+        journal_inode->file_size = journal_blocks * sb->block_size;
+    }
+}
+
+/*
+ * Tabla de inodos: la raiz, el diario y los nodos del arbol, que tienen
+ * numeros consecutivos, y el resto a cero.
+ */
+static int write_inode_table(int fd, const struct assoofs_super_block_info *sb, const struct tree *t, uint64_t journal_block, uint64_t journal_blocks) {
+    struct assoofs_inode_info *table;
+    size_t len = (t->count + 1) * sizeof(*table);
+    uint64_t i, pos = sb->inode_table_block * sb->block_size;
+    int ret;
+
+    table = alloc_aligned(len);
+    if (!table) {
+        printf("Not enough memory for the inode table.\n");
+        return -1;
+    }
+    table[0] = t->nodes[0].info;
+    fill_journal_inode(&table[1], sb, journal_block, journal_blocks);
+    for (i = 1; i < t->count; i++)
+        table[i + 1] = t->nodes[i].info;
+
+    ret = pwrite_all(fd, table, len, pos);
+    free(table);
+    if (ret || write_zeros(fd, sb->inode_table_blocks * sb->block_size - len, pos + len)) {
+        printf("The inode store was not written properly.\n");
+        return -1;
+    }
+    printf("inode store (%llu inodes) written succesfully.\n", (unsigned long long)t->count + 1);
+    return 0;
+}
+
+/*
+ * Mapa de bits de bloques o de inodos libres: un bloque por grupo, con
+ * per_group bits validos en cada uno. Quedan marcados como ocupados los
+ * elementos [0, used), los que pasan de total y los bits que sobran al final
+ * de cada bloque.
+ */
+static int write_bitmap(int fd, const struct assoofs_super_block_info *sb, uint64_t block, uint64_t per_group, uint64_t used, uint64_t total, const char *name) {
+    unsigned char *bitmap;
+    uint64_t bits_per_block = sb->block_size * 8, i, index;
+    size_t len = sb->groups_count * sb->block_size;
+    int ret;
+
+    bitmap = calloc(1, len);
+    if (!bitmap) {
+        printf("Not enough memory for the %s bitmap.\n", name);
+        return -1;
+    }
+    for (i = 0; i < len * 8; i++) {
+        index = i / bits_per_block * per_group + i % bits_per_block;
+        if (i % bits_per_block >= per_group || index < used || index >= total)
+            bitmap[i / 8] |= 1 << (i % 8);
+    }
+
+    ret = pwrite_all(fd, bitmap, len, block * sb->block_size);
+    free(bitmap);
+    if (ret) {
+        printf("Writing the %s bitmap has failed.\n", name);
+        return -1;
+    }
+    printf("%s bitmap (%llu blocks) written succesfully.\n", name, (unsigned long long)sb->groups_count);
+    return 0;
+}
+
+/*
+ * Descriptores de grupo con sus contadores: estan ocupados los bloques
+ * [0, used_blocks) y los inodos [1, used_inodes], y cada directorio cuenta en
+ * el grupo de su inodo.
+ */
+static int write_group_descs(int fd, const struct assoofs_super_block_info *sb, const struct tree *t, uint64_t used_blocks, uint64_t used_inodes) {
+    struct assoofs_group_desc *desc;
+    size_t len = sb->group_desc_blocks * sb->block_size;
+    uint64_t g, start, end, used;
+    int ret;
+
+    desc = calloc(1, len);
+    if (!desc) {
+        printf("Not enough memory for the group descriptors.\n");
+        return -1;
+    }
+    for (g = 0; g < sb->groups_count; g++) {
+        start = g * sb->blocks_per_group;
+        end = start + sb->blocks_per_group < sb->blocks_count ? start + sb->blocks_per_group : sb->blocks_count;
+        desc[g].free_blocks_count = used_blocks >= end ? 0 : end - (used_blocks > start ? used_blocks : start);
+        used = used_inodes > g * sb->inodes_per_group ? used_inodes - g * sb->inodes_per_group : 0;
+        desc[g].free_inodes_count = used >= sb->inodes_per_group ? 0 : sb->inodes_per_group - used;
+    }
+    for (g = 0; g < t->count; g++)
+        if (S_ISDIR(t->nodes[g].info.mode))
+            desc[(node_inode_no(g) - ASSOOFS_ROOTDIR_INODE_NUMBER) / sb->inodes_per_group].dirs_count++;
+
+    ret = pwrite_all(fd, desc, len, sb->group_desc_block * sb->block_size);
+    free(desc);
+    if (ret) {
+        printf("Writing the group descriptors has failed.\n");
+        return -1;
+    }
+    printf("group descriptors (%llu groups) written succesfully.\n", (unsigned long long)sb->groups_count);
+    return 0;
+}
+
+/*
+ * Diario vacio: su superbloque en el primer bloque y el resto a cero, para que
+ * la repeticion nunca confunda restos del dispositivo con transacciones.
+ */
+static int write_journal(int fd, const struct assoofs_super_block_info *sb, uint64_t journal_block, uint64_t journal_blocks) {
+    uint64_t pos = journal_block * sb->block_size;
+    struct jbd2_superblock jsb;
+
+    memset(&jsb, 0, sizeof(jsb));
+    jsb.h_magic = htonl(JBD2_MAGIC_NUMBER);
+    jsb.h_blocktype = htonl(JBD2_SUPERBLOCK_V2);
+    jsb.s_blocksize = htonl(sb->block_size);
+    jsb.s_maxlen = htonl(journal_blocks);
+    jsb.s_first = htonl(1);
+    jsb.s_sequence = htonl(1);
+
+    if (pwrite_all(fd, &jsb, sizeof(jsb), pos) || write_zeros(fd, journal_blocks * sb->block_size - sizeof(jsb), pos + sizeof(jsb))) {
+        printf("Writing the journal has failed.\n");
         return -1;
     }
-    printf("block has been written succesfully.\n");
+    printf("journal (%llu blocks) written succesfully.\n", (unsigned long long)journal_blocks);
     return 0;
 }
 
+static void usage(void) {
+    printf("Usage: mkassoofs [-b block_size] [-J journal_blocks] [-d directory | -T tar_file] [-j threads] <device>\n");
+    printf("  -b  block size in bytes, a power of two from %d to %d (default %d)\n", ASSOOFS_MIN_BLOCK_SIZE, ASSOOFS_MAX_BLOCK_SIZE, ASSOOFS_DEFAULT_BLOCK_SIZE);
+    printf("  -J  journal size in blocks, at least %d; 0 creates no journal (default %d)\n", ASSOOFS_MIN_JOURNAL_BLOCKS, ASSOOFS_DEFAULT_JOURNAL_BLOCKS);
+    printf("  -d  copy the files and directories under directory\n");
+    printf("  -T  copy the files and directories of a tar archive; - reads it from stdin\n");
+    printf("  -j  threads reading the files of -d (default: one per CPU)\n");
+    printf("Without -d or -T the volume only has README.txt.\n");
+}
+
 int main(int argc, char *argv[])
 {
-    int fd;
+    int fd, opt, tar_fd;
     ssize_t ret;
+    unsigned long block_size = ASSOOFS_DEFAULT_BLOCK_SIZE;
+    unsigned long journal_blocks = ASSOOFS_DEFAULT_JOURNAL_BLOCKS;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    char *end, *source_dir = NULL, *source_tar = NULL;
+    uint64_t blocks, per_table_block, journal_block, data_block, dirs_block, used_inodes, welcome, i;
     char welcomefile_body[] = "Hola mundo, os saludo desde un sistema de ficheros ASSOOFS.\n";
-    
-    struct assoofs_inode_info welcome = {
-        .mode = S_IFREG,
-        .inode_no = WELCOMEFILE_INODE_NUMBER,
-        .data_block_number = WELCOMEFILE_DATABLOCK_NUMBER,
-        .file_size = sizeof(welcomefile_body),
-    };
-    
-    struct assoofs_dir_record_entry record = {
-        .filename = "README.txt",
-        .inode_no = WELCOMEFILE_INODE_NUMBER,
+    struct tree tree = { 0 };
+    struct stat st;
+
+    struct assoofs_super_block_info sb = {
+        .version = 1,
+        .magic = ASSOOFS_MAGIC,
+        .block_size = ASSOOFS_DEFAULT_BLOCK_SIZE,
+        .inode_table_block = ASSOOFS_INODESTORE_BLOCK_NUMBER,
     };
 
-    if (argc != 2) {
-        printf("Usage: mkassoofs <device>\n");
+    while ((opt = getopt(argc, argv, "b:J:d:T:j:")) != -1) {
+        switch (opt) {
+        case 'b':
+            block_size = strtoul(optarg, &end, 0);
+            if (*end || block_size < ASSOOFS_MIN_BLOCK_SIZE || block_size > ASSOOFS_MAX_BLOCK_SIZE || (block_size & (block_size - 1))) {
+                printf("Invalid block size: %s\n", optarg);
+                usage();
+                return -1;
+            }
+            break;
+        case 'J':
+            journal_blocks = strtoul(optarg, &end, 0);
+            // jbd2 guarda las posiciones del diario en 32 bits
+            if (*end || (journal_blocks && journal_blocks < ASSOOFS_MIN_JOURNAL_BLOCKS) || journal_blocks > UINT32_MAX) {
+                printf("Invalid journal size: %s\n", optarg);
+                usage();
+                return -1;
+            }
+            break;
+        case 'd':
+            source_dir = optarg;
+            break;
+        case 'T':
+            source_tar = optarg;
+            break;
+        case 'j':
+            threads = strtol(optarg, &end, 0);
+            if (*end || threads < 1) {
+                printf("Invalid number of threads: %s\n", optarg);
+                usage();
+                return -1;
+            }
+            break;
+        default:
+            usage();
+            return -1;
+        }
+    }
+    if (optind != argc - 1 || (source_dir && source_tar)) {
+        usage();
         return -1;
     }
+    if (threads < 1)
+        threads = 1;
+    sb.block_size = block_size;
 
-    fd = open(argv[1], O_RDWR);
+    fd = open(argv[optind], O_RDWR);
     if (fd == -1) {
         perror("Error opening the device");
         return -1;
     }
 
+    if (sizeof(struct assoofs_inode_info) != ASSOOFS_INODE_SIZE || sizeof(welcomefile_body) > ASSOOFS_INLINE_DATA_MAX) {
+        printf("Bad on-disk inode layout.\n");
+        return -1;
+    }
+
+    /*
+     * Superbloque, tabla de inodos, mapas de bits de bloques y de inodos (un
+     * bloque de cada por grupo), descriptores de grupo, diario y, detras, los
+     * datos de los ficheros y los directorios. Cada grupo tiene tantos bloques
+     * como bits un bloque del mapa y un inodo por cada ASSOOFS_BLOCKS_PER_INODE
+     * bloques, redondeado a bloques enteros de la tabla.
+     */
+    blocks = device_blocks(fd, block_size);
+    per_table_block = block_size / sizeof(struct assoofs_inode_info);
+    sb.blocks_per_group = block_size * 8;
+    sb.groups_count = (blocks + sb.blocks_per_group - 1) / sb.blocks_per_group;
+    sb.inodes_per_group = sb.groups_count ? (blocks / ASSOOFS_BLOCKS_PER_INODE + sb.groups_count - 1) / sb.groups_count : 0;
+    sb.inodes_per_group = (sb.inodes_per_group + per_table_block - 1) / per_table_block * per_table_block;
+    if (sb.inodes_per_group < FIRST_FILE_INODE_NUMBER)
+        sb.inodes_per_group = (FIRST_FILE_INODE_NUMBER + per_table_block - 1) / per_table_block * per_table_block;
+    if (sb.inodes_per_group > sb.blocks_per_group)
+        sb.inodes_per_group = sb.blocks_per_group;
+    sb.inode_table_blocks = sb.groups_count * sb.inodes_per_group / per_table_block;
+    sb.bitmap_block = sb.inode_table_block + sb.inode_table_blocks;
+    sb.bitmap_blocks = sb.groups_count;
+    sb.inode_bitmap_block = sb.bitmap_block + sb.bitmap_blocks;
+    sb.inode_bitmap_blocks = sb.groups_count;
+    sb.group_desc_block = sb.inode_bitmap_block + sb.inode_bitmap_blocks;
+    sb.group_desc_blocks = (sb.groups_count * sizeof(struct assoofs_group_desc) + block_size - 1) / block_size;
+    journal_block = sb.group_desc_block + sb.group_desc_blocks;
+    data_block = journal_block + journal_blocks;
+    if (data_block + 2 >= blocks) { // Al menos el indice y la hoja de la raiz
+        printf("The device is too small (%llu blocks).%s\n", (unsigned long long)blocks, journal_blocks ? " Try a smaller journal (-J)." : "");
+        close(fd);
+        return -1;
+    }
+    sb.blocks_count = blocks;
+    sb.journal_inode = journal_blocks ? ASSOOFS_JOURNAL_INODE_NUMBER : 0;
+
+    tree.block_size = block_size;
+    tree.blocks = blocks;
+    tree.next_block = data_block;
+    tree_add(&tree, 0, NULL, 0, S_IFDIR);
+
+    /*
+     * Primero los datos de los ficheros, que con -T se escriben segun se leen,
+     * luego los directorios y al final los metadatos, que ya conocen todo lo
+     * ocupado. Salvo los metadatos, todo se escribe en trozos de IO_CHUNK.
+     */
     ret = 1;
     do {
-        if (write_superblock(fd))
+        if (source_dir) {
+            if (stat(source_dir, &st) == -1 || !S_ISDIR(st.st_mode)) {
+                printf("%s is not a directory.\n", source_dir);
+                break;
+            }
+            tree.nodes[0].info.mode = S_IFDIR | (st.st_mode & 07777);
+            if (scan_dir(&tree, 0, source_dir))
+                break;
+        } else if (source_tar) {
+            tar_fd = strcmp(source_tar, "-") ? open(source_tar, O_RDONLY) : STDIN_FILENO;
+            if (tar_fd == -1) {
+                perror("Error opening the tar archive");
+                break;
+            }
+            tree.nodes[0].info.mode = S_IFDIR | 0755; // Salvo que el tar traiga "./"
+            tree.lookup_size = 1024;
+            tree.lookup = calloc(tree.lookup_size, sizeof(*tree.lookup));
+            opt = !tree.lookup || read_tar(&tree, tar_fd, fd);
+            if (tar_fd != STDIN_FILENO)
+                close(tar_fd);
+            if (opt)
+                break;
+        } else {
+            // README.txt cabe en el inodo: no ocupa ningun bloque de datos
+            welcome = tree_add(&tree, 0, "README.txt", strlen("README.txt"), S_IFREG);
+            place_file(&tree, welcome, sizeof(welcomefile_body), "README.txt");
+            memcpy(tree.nodes[welcome].info.inline_data, welcomefile_body, sizeof(welcomefile_body));
+        }
+        dirs_block = tree.next_block;
+
+        used_inodes = tree.count + 1; // Mas el del diario, aunque no lo haya
+        if (used_inodes > sb.groups_count * sb.inodes_per_group) {
+            printf("Too many files for the device (%llu inodes).\n", (unsigned long long)(sb.groups_count * sb.inodes_per_group));
+            break;
+        }
+        if (place_dirs(&tree))
             break;
 
-        if (write_root_inode(fd))
+        if (source_dir && read_sources(&tree, fd, data_block, dirs_block, threads))
             break;
-        
-        if (write_welcome_inode(fd, &welcome))
+
+        if (write_dirs(&tree, fd, dirs_block))
+            break;
+
+        sb.inodes_count = used_inodes;
+        sb.free_blocks_count = blocks - tree.next_block;
+        for (i = 0; i < tree.count; i++)
+            if (S_ISDIR(tree.nodes[i].info.mode))
+                sb.dirs_count++;
+
+        if (write_superblock(fd, &sb))
             break;
 
-        if (write_dirent(fd, &record))
+        if (write_inode_table(fd, &sb, &tree, journal_block, journal_blocks))
             break;
-        
-        if (write_block(fd, welcomefile_body, welcome.file_size))
+
+        if (write_bitmap(fd, &sb, sb.bitmap_block, sb.blocks_per_group, tree.next_block, sb.blocks_count, "free block"))
+            break;
+
+        // Ocupados la raiz, el diario (aunque no lo haya) y los del arbol
+        if (write_bitmap(fd, &sb, sb.inode_bitmap_block, sb.inodes_per_group, used_inodes, sb.groups_count * sb.inodes_per_group, "free inode"))
+            break;
+
+        if (write_group_descs(fd, &sb, &tree, tree.next_block, used_inodes))
+            break;
+
+        if (journal_blocks && write_journal(fd, &sb, journal_block, journal_blocks))
             break;
 
         ret = 0;